@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include "font-config-client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Cached result. Entries are linked into both a hash bucket chain and a list
+// ordered from most to least recently used.
+typedef struct {
+  char query[FONT_CONFIG_MAX_QUERY + 1];
+  FontConfigMatch match;
+  int prev;
+  int next;
+  int bucket_next;
+} CacheEntry;
+
+struct FontConfigClient {
+  struct sockaddr_un addr;
+  int fd;
+  long generation;
+  int timeout_ms;  // Per-call limit, or 0 for none.
+
+  // "@CONTEXT\t" prefix sent before each request, or an empty string.
+  char context_prefix[FONT_CONFIG_MAX_CONTEXT + 3];
+
+  // Data read from the daemon that hasn't been consumed yet.
+  char buf[8192];
+  size_t len;
+
+  CacheEntry* entries;
+  int cache_size;
+  int num_entries;
+  int* buckets;
+  int num_buckets;
+  int lru_head;
+  int lru_tail;
+};
+
+static uint32_t HashQuery(const char* query) {
+  uint32_t hash = 2166136261u;
+  for (; *query; query++)
+    hash = (hash ^ (unsigned char) *query) * 16777619u;
+  return hash;
+}
+
+static void ClearCache(FontConfigClient* client) {
+  client->num_entries = 0;
+  client->lru_head = client->lru_tail = -1;
+  for (int i = 0; i < client->num_buckets; i++)
+    client->buckets[i] = -1;
+}
+
+static void UnlinkFromLru(FontConfigClient* client, int index) {
+  CacheEntry* entry = &client->entries[index];
+  if (entry->prev >= 0)
+    client->entries[entry->prev].next = entry->next;
+  else
+    client->lru_head = entry->next;
+  if (entry->next >= 0)
+    client->entries[entry->next].prev = entry->prev;
+  else
+    client->lru_tail = entry->prev;
+}
+
+static void PushToLruHead(FontConfigClient* client, int index) {
+  CacheEntry* entry = &client->entries[index];
+  entry->prev = -1;
+  entry->next = client->lru_head;
+  if (client->lru_head >= 0)
+    client->entries[client->lru_head].prev = index;
+  client->lru_head = index;
+  if (client->lru_tail < 0)
+    client->lru_tail = index;
+}
+
+// Returns the cached match for |query| and marks it as recently used, or NULL
+// if it isn't cached.
+static const FontConfigMatch* LookUpCache(FontConfigClient* client,
+                                          const char* query) {
+  if (client->cache_size <= 0)
+    return NULL;
+  int index = client->buckets[HashQuery(query) % client->num_buckets];
+  for (; index >= 0; index = client->entries[index].bucket_next) {
+    if (strcmp(client->entries[index].query, query) == 0) {
+      UnlinkFromLru(client, index);
+      PushToLruHead(client, index);
+      return &client->entries[index].match;
+    }
+  }
+  return NULL;
+}
+
+// Adds |match| for |query|, evicting the least recently used entry if the
+// cache is full.
+static void AddToCache(FontConfigClient* client,
+                       const char* query,
+                       const FontConfigMatch* match) {
+  if (client->cache_size <= 0 || LookUpCache(client, query))
+    return;
+
+  int index = client->num_entries;
+  if (client->num_entries < client->cache_size) {
+    client->num_entries++;
+  } else {
+    index = client->lru_tail;
+    UnlinkFromLru(client, index);
+    int* link = &client->buckets[HashQuery(client->entries[index].query) %
+                                 client->num_buckets];
+    while (*link != index)
+      link = &client->entries[*link].bucket_next;
+    *link = client->entries[index].bucket_next;
+  }
+
+  CacheEntry* entry = &client->entries[index];
+  snprintf(entry->query, sizeof(entry->query), "%s", query);
+  entry->match = *match;
+  int* bucket = &client->buckets[HashQuery(query) % client->num_buckets];
+  entry->bucket_next = *bucket;
+  *bucket = index;
+  PushToLruHead(client, index);
+}
+
+static void Disconnect(FontConfigClient* client) {
+  if (client->fd >= 0)
+    close(client->fd);
+  client->fd = -1;
+  client->len = 0;
+}
+
+// Connects to the daemon if not already connected. Results cached from an
+// earlier connection are dropped, since the daemon may have restarted with a
+// different config. Returns 0 on success.
+static int Connect(FontConfigClient* client) {
+  if (client->fd >= 0)
+    return 0;
+  client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (client->fd < 0)
+    return -1;
+  if (connect(client->fd, (struct sockaddr*) &client->addr,
+              sizeof(client->addr)) != 0) {
+    Disconnect(client);
+    return -1;
+  }
+  ClearCache(client);
+  return 0;
+}
+
+// Returns the current time on a monotonic clock in milliseconds.
+static long long GetMonotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Returns the poll() timeout left until |deadline_ms|, which is 0 for no
+// deadline.
+static int GetPollTimeout(long long deadline_ms) {
+  if (deadline_ms == 0)
+    return -1;
+  const long long remaining = deadline_ms - GetMonotonicMs();
+  return remaining > 0 ? (int) remaining : 0;
+}
+
+// Handles a control line from the daemon.
+static void HandleControlLine(FontConfigClient* client, const char* line) {
+  const size_t prefix_len = strlen(FONT_CONFIG_GENERATION_PREFIX);
+  if (strncmp(line, FONT_CONFIG_GENERATION_PREFIX, prefix_len) == 0) {
+    const long generation = atol(line + prefix_len);
+    if (generation != client->generation)
+      ClearCache(client);
+    client->generation = generation;
+  }
+}
+
+// Moves the next complete line out of |client|'s buffer into |line|, without
+// its newline. Returns 0 on success or -1 if no complete line is buffered.
+static int TakeBufferedLine(FontConfigClient* client,
+                            char* line,
+                            size_t size) {
+  char* newline = memchr(client->buf, '\n', client->len);
+  if (!newline)
+    return -1;
+  const size_t line_len = newline - client->buf;
+  snprintf(line, size, "%.*s", (int) line_len, client->buf);
+  client->len -= line_len + 1;
+  memmove(client->buf, newline + 1, client->len);
+  return 0;
+}
+
+// Reads more data from the daemon into |client|'s buffer. Returns 0 on success
+// or -1 if the connection failed or the buffer is full.
+static int FillBuffer(FontConfigClient* client) {
+  if (client->len == sizeof(client->buf))
+    return -1;
+  ssize_t len = 0;
+  do {
+    len = read(client->fd, client->buf + client->len,
+               sizeof(client->buf) - client->len);
+  } while (len < 0 && errno == EINTR);
+  if (len <= 0)
+    return -1;
+  client->len += len;
+  return 0;
+}
+
+// Processes control lines that the daemon pushed while no requests were
+// outstanding, so that generation changes are noticed before answering from
+// the cache.
+static void ProcessPushedLines(FontConfigClient* client) {
+  struct pollfd fd = { client->fd, POLLIN, 0 };
+  while (client->fd >= 0 && poll(&fd, 1, 0) > 0) {
+    if (FillBuffer(client) != 0) {
+      Disconnect(client);
+      ClearCache(client);
+      return;
+    }
+    char line[sizeof(client->buf)];
+    while (TakeBufferedLine(client, line, sizeof(line)) == 0)
+      HandleControlLine(client, line);
+  }
+}
+
+// Takes the next buffered response line, handling any control lines before
+// it. Returns 0 on success or -1 if no complete response is buffered.
+static int TakeBufferedResponse(FontConfigClient* client,
+                                char* line,
+                                size_t size) {
+  while (TakeBufferedLine(client, line, size) == 0) {
+    if (line[0] != '#')
+      return 0;
+    HandleControlLine(client, line);
+  }
+  return -1;
+}
+
+// Parses a response line for |query| into |match|. Returns 0 on success.
+static int ParseResponse(const char* query,
+                         char* line,
+                         FontConfigMatch* match) {
+  // Split on every tab, since fields like the style may be empty.
+  char* fields[9];
+  int num_fields = 0;
+  char* field = NULL;
+  while ((field = strsep(&line, "\t"))) {
+    if (num_fields == 9)
+      return -1;
+    fields[num_fields++] = field;
+  }
+  if (num_fields != 9 || strcmp(fields[0], query) != 0)
+    return -1;
+
+  memset(match, 0, sizeof(*match));
+  snprintf(match->family, sizeof(match->family), "%s", fields[1]);
+  snprintf(match->style, sizeof(match->style), "%s", fields[2]);
+  char* colon = strrchr(fields[3], ':');
+  if (colon) {
+    *colon = '\0';
+    match->index = atoi(colon + 1);
+  }
+  snprintf(match->file, sizeof(match->file), "%s", fields[3]);
+  match->pixel_size = atof(fields[4]);
+  match->antialias = atoi(fields[5]);
+  match->hinting = atoi(fields[6]);
+  snprintf(match->hint_style, sizeof(match->hint_style), "%s", fields[7]);
+  snprintf(match->rgba, sizeof(match->rgba), "%s", fields[8]);
+  return 0;
+}
+
+FontConfigClient* FontConfigClientCreate(const char* socket_path,
+                                         int cache_size,
+                                         int timeout_ms) {
+  FontConfigClient* client = calloc(1, sizeof(FontConfigClient));
+  if (!client)
+    return NULL;
+  client->fd = -1;
+  client->generation = -1;
+  client->timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+  client->addr.sun_family = AF_UNIX;
+  client->cache_size = cache_size > 0 ? cache_size : 0;
+  client->num_buckets = client->cache_size > 0 ? client->cache_size * 2 : 1;
+  client->entries = calloc(client->cache_size + 1, sizeof(CacheEntry));
+  client->buckets = calloc(client->num_buckets, sizeof(int));
+  if (strlen(socket_path) >= sizeof(client->addr.sun_path) ||
+      !client->entries || !client->buckets) {
+    FontConfigClientDestroy(client);
+    return NULL;
+  }
+  strcpy(client->addr.sun_path, socket_path);
+  ClearCache(client);
+
+  if (Connect(client) != 0) {
+    FontConfigClientDestroy(client);
+    return NULL;
+  }
+  return client;
+}
+
+// Sends the |request_len| bytes of |request| for the |num_pending| uncached
+// descriptions whose indexes in |descs| are in |pending|, and stores their
+// results as FontConfigClientMatchMany() does. Responses are read while the
+// request is sent, so that neither side blocks on the other when the request
+// doesn't fit in the socket buffers. Gives up at |deadline_ms| unless it is 0.
+// Returns the number of successful matches, or -1 if the connection failed
+// before any response was read.
+static int ExchangeRequests(FontConfigClient* client,
+                            const char* request,
+                            size_t request_len,
+                            const char* const* descs,
+                            const int* pending,
+                            int num_pending,
+                            FontConfigMatch* matches,
+                            int* failed,
+                            long long deadline_ms) {
+  size_t sent = 0;
+  int num_read = 0, num_matched = 0;
+  char line[sizeof(client->buf)];
+  while (num_read < num_pending) {
+    if (TakeBufferedResponse(client, line, sizeof(line)) == 0) {
+      const int index = pending[num_read++];
+      if (ParseResponse(descs[index], line, &matches[index]) != 0)
+        continue;
+      AddToCache(client, descs[index], &matches[index]);
+      if (failed)
+        failed[index] = 0;
+      num_matched++;
+      continue;
+    }
+
+    struct pollfd fd = {
+      client->fd, POLLIN | (sent < request_len ? POLLOUT : 0), 0
+    };
+    const int num_ready = poll(&fd, 1, GetPollTimeout(deadline_ms));
+    if (num_ready < 0 && errno == EINTR)
+      continue;
+    if (num_ready <= 0)
+      break;
+    if (fd.revents & POLLOUT) {
+      const ssize_t written = send(client->fd, request + sent,
+                                   request_len - sent,
+                                   MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (written > 0)
+        sent += written;
+      else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+        break;
+    }
+    if ((fd.revents & (POLLIN | POLLHUP | POLLERR)) && FillBuffer(client) != 0)
+      break;
+  }
+  if (num_read == num_pending)
+    return num_matched;
+  Disconnect(client);
+  return num_read > 0 ? num_matched : -1;
+}
+
+void FontConfigClientDestroy(FontConfigClient* client) {
+  if (!client)
+    return;
+  Disconnect(client);
+  free(client->entries);
+  free(client->buckets);
+  free(client);
+}
+
+int FontConfigClientMatch(FontConfigClient* client,
+                          const char* desc,
+                          FontConfigMatch* match) {
+  int failed = 0;
+  return FontConfigClientMatchMany(client, &desc, 1, match, &failed) == 1 ?
+      0 : -1;
+}
+
+int FontConfigClientMatchMany(FontConfigClient* client,
+                              const char* const* descs,
+                              int num_descs,
+                              FontConfigMatch* matches,
+                              int* failed) {
+  const long long deadline_ms =
+      client->timeout_ms > 0 ? GetMonotonicMs() + client->timeout_ms : 0;
+  ProcessPushedLines(client);
+
+  // Answer what we can from the cache and build a pipelined request for the
+  // rest.
+  const size_t prefix_len = strlen(client->context_prefix);
+  char* request =
+      malloc((size_t) num_descs * (prefix_len + FONT_CONFIG_MAX_QUERY + 1) + 1);
+  int* pending = malloc((num_descs + 1) * sizeof(int));
+  if (!request || !pending) {
+    free(request);
+    free(pending);
+    return 0;
+  }
+  size_t request_len = 0;
+  int num_pending = 0, num_matched = 0;
+  for (int i = 0; i < num_descs; i++) {
+    const size_t len = strlen(descs[i]);
+    const FontConfigMatch* cached = NULL;
+    if (failed)
+      failed[i] = 1;
+    if (len == 0 || len > FONT_CONFIG_MAX_QUERY ||
+        strpbrk(descs[i], "\t\r\n") || descs[i][0] == '#')
+      continue;
+    if ((cached = LookUpCache(client, descs[i]))) {
+      matches[i] = *cached;
+      if (failed)
+        failed[i] = 0;
+      num_matched++;
+      continue;
+    }
+    memcpy(request + request_len, client->context_prefix, prefix_len);
+    request_len += prefix_len;
+    memcpy(request + request_len, descs[i], len);
+    request_len += len;
+    request[request_len++] = '\n';
+    pending[num_pending++] = i;
+  }
+
+  if (num_pending > 0) {
+    // Retry once on a fresh connection in case the daemon went away, unless
+    // the deadline has already passed.
+    int num_answered = -1;
+    for (int attempt = 0; attempt < 2 && num_answered < 0 &&
+         (attempt == 0 || GetPollTimeout(deadline_ms) != 0); attempt++) {
+      if (Connect(client) == 0) {
+        num_answered = ExchangeRequests(client, request, request_len, descs,
+                                        pending, num_pending, matches, failed,
+                                        deadline_ms);
+      }
+    }
+    if (num_answered > 0)
+      num_matched += num_answered;
+  }
+
+  free(request);
+  free(pending);
+  return num_matched;
+}
+
+int FontConfigClientSetContext(FontConfigClient* client, const char* context) {
+  if (context && (strlen(context) > FONT_CONFIG_MAX_CONTEXT ||
+                  strpbrk(context, "\t\r\n")))
+    return -1;
+  if (context)
+    snprintf(client->context_prefix, sizeof(client->context_prefix), "@%s\t",
+             context);
+  else
+    client->context_prefix[0] = '\0';
+  ClearCache(client);
+  return 0;
+}
+
+long FontConfigClientGetGeneration(const FontConfigClient* client) {
+  return client->generation;
+}
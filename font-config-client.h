@@ -0,0 +1,94 @@
+// Client for the font-config-info --daemon protocol.
+//
+// Each request is a line containing a Pango-style font description like
+// "DejaVu Sans Bold 10", and the daemon replies to each with a tab-separated
+// line in the same order:
+//
+//   query family style file:index pixelsize antialias hinting hintstyle rgba
+//
+// A request may be prefixed by "@CONTEXT<TAB>" to resolve it against another
+// config, where CONTEXT is "sysroot=DIR", "file=PATH" or "home=DIR". Only
+// clients running as the daemon's user may do this.
+//
+// The daemon also sends control lines starting with '#'. A generation line is
+// sent when a client connects and whenever the daemon's config changes, at
+// which point cached results are stale.
+
+#ifndef FONT_CONFIG_CLIENT_H_
+#define FONT_CONFIG_CLIENT_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Prefix of the control line carrying the daemon's config generation.
+#define FONT_CONFIG_GENERATION_PREFIX "#generation "
+
+// Maximum length of a font description in a request. Longer descriptions are
+// rejected.
+#define FONT_CONFIG_MAX_QUERY 127
+
+// Maximum length of a config context name, chosen so that a prefixed request
+// still fits in the daemon's line buffer.
+#define FONT_CONFIG_MAX_CONTEXT 1024
+
+// Match returned by the daemon.
+typedef struct {
+  char family[128];
+  char style[64];
+  char file[4096];
+  int index;
+  double pixel_size;
+  int antialias;  // 1, 0, or -1 if unset.
+  int hinting;    // 1, 0, or -1 if unset.
+  char hint_style[16];
+  char rgba[16];
+} FontConfigMatch;
+
+typedef struct FontConfigClient FontConfigClient;
+
+// Connects to the daemon listening at |socket_path| and returns a new client
+// that caches up to |cache_size| results, or NULL on failure. The connection
+// is kept open and is reestablished if it breaks. If |timeout_ms| is positive,
+// each match call gives up on the daemon after that long and reports the
+// descriptions it hasn't answered as failed, so that callers can fall back to
+// Fontconfig.
+FontConfigClient* FontConfigClientCreate(const char* socket_path,
+                                         int cache_size,
+                                         int timeout_ms);
+
+void FontConfigClientDestroy(FontConfigClient* client);
+
+// Matches |desc| and stores the result in |match|. Returns 0 on success or -1
+// on failure.
+int FontConfigClientMatch(FontConfigClient* client,
+                          const char* desc,
+                          FontConfigMatch* match);
+
+// Matches the |num_descs| descriptions in |descs|, storing results in the
+// corresponding elements of |matches|. Uncached requests are pipelined, with
+// responses read while the requests are sent. Returns the number of successful
+// matches; |failed| (if non-NULL) receives a flag for each description.
+int FontConfigClientMatchMany(FontConfigClient* client,
+                              const char* const* descs,
+                              int num_descs,
+                              FontConfigMatch* matches,
+                              int* failed);
+
+// Resolves subsequent requests against the config context |context| (e.g.
+// "home=/home/foo"), or against the daemon's default config if it is NULL.
+// Cached results are dropped. Returns 0 on success or -1 if |context| is too
+// long or contains a tab or newline.
+int FontConfigClientSetContext(FontConfigClient* client, const char* context);
+
+// Returns the most recent config generation received from the daemon, or -1
+// if none has been received.
+long FontConfigClientGetGeneration(const FontConfigClient* client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FONT_CONFIG_CLIENT_H_
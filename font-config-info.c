@@ -1,20 +1,53 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <execinfo.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_BBOX_H
+#include FT_LCD_FILTER_H
+#include FT_OUTLINE_H
 #include <gdk/gdkx.h>
 #include <gio/gio.h>
 #include <gtk/gtk.h>
+#include <hb.h>
+#include <hb-ot.h>
 #include <X11/Xlib.h>
 #include <X11/Xresource.h>
 
+#include "font-config-client.h"
+
 #define NAME_FORMAT "%-20s "
 
 const char* GetFontconfigResultString(FcResult result) {
@@ -68,6 +101,21 @@ const char* GetFontconfigRgbaString(int rgba) {
   }
 }
 
+const char* GetFontconfigLcdFilterString(int filter) {
+  switch (filter) {
+    case FC_LCD_NONE:
+      return "none";
+    case FC_LCD_DEFAULT:
+      return "default";
+    case FC_LCD_LIGHT:
+      return "light";
+    case FC_LCD_LEGACY:
+      return "legacy";
+    default:
+      return "invalid";
+  }
+}
+
 void PrintGtkBoolSetting(GtkSettings* settings, const char* name) {
   gint value = -1;
   g_object_get(settings, name, &value, NULL);
@@ -144,30 +192,32 @@ void PrintGSettingsSetting(GSettings* settings,
   g_variant_unref(variant);
 }
 
-void PrintGnomeSettings() {
-  const char kSchema[] = "org.gnome.desktop.interface";
-  printf("GSettings (%s):\n", kSchema);
+// GSettings schema containing GNOME's font settings.
+const char kGnomeInterfaceSchema[] = "org.gnome.desktop.interface";
 
+// Returns true if the GSettings schema |id| is installed.
+int HasGSettingsSchema(const char* id) {
   gchar** schemas = NULL;
-  int found_schema = 0;
-
   g_settings_schema_source_list_schemas(g_settings_schema_source_get_default(),
 					TRUE,
 					&schemas,
 					NULL);
 
   for ( ; *schemas; schemas++) {
-    if (strcmp(kSchema, *schemas) == 0) {
-      found_schema = 1;
-      break;
-    }
+    if (strcmp(id, *schemas) == 0)
+      return 1;
   }
-  if (!found_schema) {
+  return 0;
+}
+
+void PrintGnomeSettings() {
+  printf("GSettings (%s):\n", kGnomeInterfaceSchema);
+  if (!HasGSettingsSchema(kGnomeInterfaceSchema)) {
     printf("schema not found; maybe GNOME isn't present\n\n");
     return;
   }
 
-  GSettings* settings = g_settings_new(kSchema);
+  GSettings* settings = g_settings_new(kGnomeInterfaceSchema);
   assert(settings);
   PrintGSettingsSetting(settings, "font-name");
   PrintGSettingsSetting(settings, "text-scaling-factor");
@@ -210,6 +260,23 @@ void PrintXResource(XrmDatabase db, const char* name) {
   printf(NAME_FORMAT "\"%s\"\n", name, str);
 }
 
+// Xft resources that are looked up and printed in every X resources section.
+const char* kXftResourceNames[] = {
+  "Xft.antialias",
+  "Xft.hinting",
+  "Xft.hintstyle",
+  "Xft.rgba",
+  "Xft.lcdfilter",
+  "Xft.dpi",
+};
+
+void PrintXftResources(XrmDatabase db) {
+  for (size_t i = 0; i < sizeof(kXftResourceNames) / sizeof(*kXftResourceNames);
+       i++) {
+    PrintXResource(db, kXftResourceNames[i]);
+  }
+}
+
 void PrintXResources() {
   printf("X resources (xrdb):\n");
   Display* display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
@@ -222,15 +289,308 @@ void PrintXResources() {
   }
 
   XrmDatabase db = XrmGetStringDatabase(data);
-  PrintXResource(db, "Xft.antialias");
-  PrintXResource(db, "Xft.hinting");
-  PrintXResource(db, "Xft.hintstyle");
-  PrintXResource(db, "Xft.rgba");
-  PrintXResource(db, "Xft.dpi");
+  PrintXftResources(db);
+  XrmDestroyDatabase(db);
+  printf("\n");
+}
+
+// Returns a monotonic timestamp in nanoseconds.
+double GetTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Formats |ns| into |str| using an appropriate unit.
+void FormatDuration(double ns, char* str, size_t size) {
+  if (ns >= 1e9)
+    snprintf(str, size, "%.3f s", ns / 1e9);
+  else if (ns >= 1e6)
+    snprintf(str, size, "%.3f ms", ns / 1e6);
+  else if (ns >= 1e3)
+    snprintf(str, size, "%.3f us", ns / 1e3);
+  else
+    snprintf(str, size, "%.1f ns", ns);
+}
+
+// XLFD patterns whose core font lookups are timed. They cover the server's
+// "fixed" alias and fonts that legacy toolkits commonly request.
+const char* kXCoreFontPatterns[] = {
+  "fixed",
+  "-misc-fixed-medium-r-normal--13-*-*-*-*-*-iso10646-1",
+  "-*-helvetica-medium-r-normal--12-*-*-*-*-*-iso8859-1",
+  "-*-courier-medium-r-normal--14-*-*-*-*-*-*-*",
+  "-*-*-medium-r-normal--*-*-*-*-*-*-iso10646-1",
+};
+
+// Maximum number of names requested from XListFonts().
+#define X_CORE_MAX_FONTS 65535
+
+// Number of times that each core font lookup is timed with --x-font-timing.
+// Listing keeps the fastest run, and loading reports the first run separately
+// from the fastest later one.
+#define X_CORE_FONT_REPS 5
+
+// Returns the number of fonts listed in the fonts.dir file in |dir|, or -1 if
+// it can't be read.
+int GetFontsDirCount(const char* dir) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/fonts.dir", dir);
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -1;
+  int count = -1;
+  if (fscanf(file, "%d", &count) != 1)
+    count = -1;
+  fclose(file);
+  return count;
+}
+
+// Describes the fonts available from font path element |element| in |str|,
+// which has room for |size| bytes. Local directories are counted from their
+// fonts.dir files, including the directories linked from a catalogue.
+void DescribeFontPathElement(const char* element, char* str, size_t size) {
+  if (strcmp(element, "built-ins") == 0) {
+    snprintf(str, size, "[built-in]");
+  } else if (strncmp(element, "catalogue:", 10) == 0) {
+    const char* dir = element + 10;
+    DIR* catalogue = opendir(dir);
+    if (!catalogue) {
+      snprintf(str, size, "[missing]");
+      return;
+    }
+    int num_dirs = 0, num_fonts = 0;
+    struct dirent* entry = NULL;
+    while ((entry = readdir(catalogue))) {
+      if (entry->d_name[0] == '.')
+        continue;
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      const int count = GetFontsDirCount(path);
+      if (count >= 0) {
+        num_dirs++;
+        num_fonts += count;
+      }
+    }
+    closedir(catalogue);
+    snprintf(str, size, "%d (fonts.dir in %d linked dir(s))", num_fonts,
+             num_dirs);
+  } else if (element[0] == '/') {
+    // Elements may carry attributes like ":unscaled" after the directory.
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", element);
+    char* colon = strchr(dir, ':');
+    if (colon)
+      *colon = '\0';
+    const int count = GetFontsDirCount(dir);
+    if (count >= 0)
+      snprintf(str, size, "%d (fonts.dir)", count);
+    else
+      snprintf(str, size, "[no fonts.dir]");
+  } else {
+    snprintf(str, size, "[font server]");
+  }
+}
+
+// Prints the X server's core font path with the number of fonts that each
+// element provides, and times listing fonts matching common XLFD patterns.
+// Each call is a server round trip, and elements served by a font server add
+// another, so lookups are only repeated and fonts loaded if |time_loads| is
+// set.
+void PrintXCoreFonts(int time_loads) {
+  printf("X core fonts:\n");
+  Display* display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+  assert(display);
+
+  int num_elements = 0;
+  char** path = XGetFontPath(display, &num_elements);
+  printf("%-52s %s\n", "path element", "fonts");
+  for (int i = 0; i < num_elements; i++) {
+    char str[64];
+    DescribeFontPathElement(path[i], str, sizeof(str));
+    printf("%-52s %s\n", path[i], str);
+  }
+  if (num_elements == 0)
+    printf("[empty]\n");
+  if (path)
+    XFreeFontPath(path);
+
+  if (time_loads) {
+    printf("%-52s %-8s %-12s %-12s %s\n", "pattern", "matches", "list",
+           "load (first)", "load (warm)");
+  } else {
+    printf("%-52s %-8s %s\n", "pattern", "matches", "list");
+  }
+  for (size_t i = 0;
+       i < sizeof(kXCoreFontPatterns) / sizeof(*kXCoreFontPatterns); i++) {
+    const char* pattern = kXCoreFontPatterns[i];
+    int num_matches = 0;
+    double list_ns = -1.0, first_ns = -1.0, warm_ns = -1.0;
+    for (int rep = 0; rep < (time_loads ? X_CORE_FONT_REPS : 1); rep++) {
+      double start = GetTimeNs();
+      char** names = XListFonts(display, pattern, X_CORE_MAX_FONTS,
+                                &num_matches);
+      const double elapsed = GetTimeNs() - start;
+      if (names)
+        XFreeFontNames(names);
+      if (list_ns < 0 || elapsed < list_ns)
+        list_ns = elapsed;
+      if (!time_loads)
+        continue;
+
+      start = GetTimeNs();
+      XFontStruct* font = XLoadQueryFont(display, pattern);
+      const double load_ns = GetTimeNs() - start;
+      if (!font)
+        continue;
+      XFreeFont(display, font);
+      if (rep == 0)
+        first_ns = load_ns;
+      else if (warm_ns < 0 || load_ns < warm_ns)
+        warm_ns = load_ns;
+    }
+
+    char list_str[32], first_str[32] = "[none]", warm_str[32] = "[none]";
+    FormatDuration(list_ns, list_str, sizeof(list_str));
+    if (!time_loads) {
+      printf("%-52s %-8d %s\n", pattern, num_matches, list_str);
+      continue;
+    }
+    if (first_ns >= 0)
+      FormatDuration(first_ns, first_str, sizeof(first_str));
+    if (warm_ns >= 0)
+      FormatDuration(warm_ns, warm_str, sizeof(warm_str));
+    printf("%-52s %-8d %-12s %-12s %s\n", pattern, num_matches, list_str,
+           first_str, warm_str);
+  }
+  printf("\n");
+}
+
+// Returns true if resource name component |str| looks font-related, i.e. it
+// contains "font", ignoring case, or the word "face" (as in XTerm's faceName
+// and faceSize, but not Surface or interface).
+int IsFontResourceComponent(const char* str) {
+  for (const char* p = str; *p; p++) {
+    if (strncasecmp(p, "font", 4) == 0)
+      return 1;
+    const int word_start = p == str || !isalpha((unsigned char) p[-1]) ||
+        (islower((unsigned char) p[-1]) && p[0] == 'F');
+    if (word_start && strncasecmp(p, "face", 4) == 0 &&
+        !islower((unsigned char) p[4]))
+      return 1;
+  }
+  return 0;
+}
+
+// XrmEnumerateDatabase() callback that prints all Xft and font-related
+// entries.
+Bool PrintFontXResourceEntry(XrmDatabase* db,
+                             XrmBindingList bindings,
+                             XrmQuarkList quarks,
+                             XrmRepresentation* type,
+                             XrmValue* value,
+                             XPointer closure) {
+  char name[256] = "";
+  int font_related = 0;
+  for (int i = 0; quarks[i] != NULLQUARK; i++) {
+    const char* component = XrmQuarkToString(quarks[i]);
+    if ((i == 0 && strcmp(component, "Xft") == 0) ||
+        IsFontResourceComponent(component))
+      font_related = 1;
+    // Leading tight bindings are implicit, so only print loose ones.
+    if (i > 0 || bindings[i] == XrmBindLoosely) {
+      strncat(name, bindings[i] == XrmBindLoosely ? "*" : ".",
+              sizeof(name) - strlen(name) - 1);
+    }
+    strncat(name, component, sizeof(name) - strlen(name) - 1);
+  }
+  if (font_related) {
+    printf(NAME_FORMAT "\"%.*s\"\n", name,
+           value->size ? (int) value->size - 1 : 0, (const char*) value->addr);
+  }
+  return False;
+}
+
+// Loads |path| with Xrm (which handles "#include" directives itself but doesn't
+// run the file through cpp the way that xrdb does) and prints the Xft and
+// font-related resources that it contains.
+void PrintXResourcesFile(const char* path) {
+  printf("X resources (%s):\n", path);
+  XrmDatabase db = XrmGetFileDatabase(path);
+  if (!db) {
+    printf("[failed]\n\n");
+    return;
+  }
+
+  PrintXftResources(db);
+  printf("font-related entries:\n");
+  XrmQuark empty = NULLQUARK;
+  XrmEnumerateDatabase(db, &empty, &empty, XrmEnumAllLevels,
+                       PrintFontXResourceEntry, NULL);
   XrmDestroyDatabase(db);
   printf("\n");
 }
 
+// Prints the resources from the Xresources files in |home| without connecting
+// to an X server.
+void PrintHomeXResources(const char* home) {
+  const char* kFilenames[] = { ".Xresources", ".Xdefaults" };
+  for (size_t i = 0; i < sizeof(kFilenames) / sizeof(*kFilenames); i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", home, kFilenames[i]);
+    if (access(path, R_OK) == 0)
+      PrintXResourcesFile(path);
+    else
+      printf("X resources (%s):\n[missing]\n\n", path);
+  }
+}
+
+// Calls PrintHomeXResources() for each of the |num_homes| directories in
+// |homes|. Xrm isn't thread-safe, so each directory is handled in a forked
+// child that writes to a temporary file, with at most one child per online CPU
+// running at a time. The files are copied to stdout in the original order.
+void PrintOfflineXResources(const char** homes, int num_homes) {
+  XrmInitialize();
+  fflush(NULL);
+
+  long max_children = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_children < 1)
+    max_children = 1;
+
+  FILE** outputs = calloc(num_homes, sizeof(FILE*));
+  assert(outputs);
+  int running = 0;
+  for (int i = 0; i < num_homes; i++) {
+    if (running >= max_children) {
+      wait(NULL);
+      running--;
+    }
+    outputs[i] = tmpfile();
+    assert(outputs[i]);
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      dup2(fileno(outputs[i]), STDOUT_FILENO);
+      PrintHomeXResources(homes[i]);
+      fflush(NULL);
+      _exit(0);
+    }
+    running++;
+  }
+  while (running-- > 0)
+    wait(NULL);
+
+  for (int i = 0; i < num_homes; i++) {
+    char buf[4096];
+    size_t len = 0;
+    rewind(outputs[i]);
+    while ((len = fread(buf, 1, sizeof(buf), outputs[i])) > 0)
+      fwrite(buf, 1, len, stdout);
+    fclose(outputs[i]);
+  }
+  free(outputs);
+}
+
 void PrintFontconfigString(FcPattern* match, const char* prop) {
   FcChar8* value = NULL;
   FcResult result = FcResultNoMatch;
@@ -290,52 +650,92 @@ void PrintFontconfigPattern(FcPattern* pattern,
   printf("\n");
 }
 
-void PrintFontconfigMatch(const char* user_desc_string, int bold, int italic) {
-  PangoFontDescription* desc = NULL;
-  if (user_desc_string) {
-    desc = pango_font_description_from_string(user_desc_string);
-  } else {
-    GtkWidget* widget = gtk_label_new("foo");
-    desc = pango_font_description_copy(gtk_rc_get_style(widget)->font_desc);
-    g_object_ref_sink(widget);
-  }
+// Returns the Pango font description parsed from |user_desc_string|, or the
+// default GTK label font if it is NULL. The caller must free the description.
+PangoFontDescription* GetFontDescription(const char* user_desc_string) {
+  if (user_desc_string)
+    return pango_font_description_from_string(user_desc_string);
 
-  gchar* desc_string = pango_font_description_to_string(desc);
-  printf("Fontconfig (%s):\n", desc_string);
-  g_free(desc_string);
+  GtkWidget* widget = gtk_label_new("foo");
+  PangoFontDescription* desc =
+      pango_font_description_copy(gtk_rc_get_style(widget)->font_desc);
+  g_object_ref_sink(widget);
+  return desc;
+}
 
+// Returns a new, unsubstituted Fontconfig pattern requesting the family and
+// size from |desc|.
+FcPattern* CreateFontconfigQuery(const PangoFontDescription* desc,
+                                 int bold,
+                                 int italic) {
   FcPattern* pattern = FcPatternCreate();
   assert(pattern);
 
   FcPatternAddString(pattern, FC_FAMILY,
                      (const FcChar8*) pango_font_description_get_family(desc));
-  if (bold) {
+  if (bold)
     FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-    printf(NAME_FORMAT "FC_WEIGHT_BOLD\n", "requested weight");
-  }
-  if (italic) {
+  if (italic)
     FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-    printf(NAME_FORMAT "FC_SLANT_ITALIC\n", "requested slant");
-  }
 
   // Pass either pixel or points depending on what was requested.
   if (pango_font_description_get_size_is_absolute(desc)) {
-    const double pixel_size =
-        pango_font_description_get_size(desc) / PANGO_SCALE;
-    FcPatternAddDouble(pattern, FC_PIXEL_SIZE, pixel_size);
-    printf(NAME_FORMAT "%.2f pixels\n", "requested size", pixel_size);
+    FcPatternAddDouble(pattern, FC_PIXEL_SIZE,
+                       pango_font_description_get_size(desc) / PANGO_SCALE);
   } else {
-    const int point_size = pango_font_description_get_size(desc) / PANGO_SCALE;
-    FcPatternAddInteger(pattern, FC_SIZE, point_size);
-    printf(NAME_FORMAT "%d points\n", "requested size", point_size);
+    FcPatternAddInteger(pattern, FC_SIZE,
+                        pango_font_description_get_size(desc) / PANGO_SCALE);
   }
+  return pattern;
+}
 
-  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
-  FcDefaultSubstitute(pattern);
+// Returns the best match for |query| from |config|, or from the current config
+// if it is NULL. |query| is substituted in-place.
+FcPattern* MatchFontconfigQuery(FcConfig* config, FcPattern* query) {
+  FcConfigSubstitute(config, query, FcMatchPattern);
+  FcDefaultSubstitute(query);
   FcResult result;
-  FcPattern* match = FcFontMatch(0, pattern, &result);
+  FcPattern* match = FcFontMatch(config, query, &result);
   assert(match);
+  return match;
+}
+
+// Creates a config from the file at |path| with its fonts loaded, or returns
+// NULL on failure.
+FcConfig* LoadFontconfigConfig(const char* path) {
+  FcConfig* config = FcConfigCreate();
+  assert(config);
+  if (!FcConfigParseAndLoad(config, (const FcChar8*) path, FcTrue) ||
+      !FcConfigBuildFonts(config)) {
+    FcConfigDestroy(config);
+    return NULL;
+  }
+  return config;
+}
+
+void PrintFontconfigMatch(const char* user_desc_string, int bold, int italic) {
+  PangoFontDescription* desc = GetFontDescription(user_desc_string);
+  gchar* desc_string = pango_font_description_to_string(desc);
+  printf("Fontconfig (%s):\n", desc_string);
+  g_free(desc_string);
+
+  FcPattern* pattern = CreateFontconfigQuery(desc, bold, italic);
+  if (bold)
+    printf(NAME_FORMAT "FC_WEIGHT_BOLD\n", "requested weight");
+  if (italic)
+    printf(NAME_FORMAT "FC_SLANT_ITALIC\n", "requested slant");
+
+  double pixel_size = 0.0;
+  int point_size = 0;
+  if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size) ==
+      FcResultMatch) {
+    printf(NAME_FORMAT "%.2f pixels\n", "requested size", pixel_size);
+  } else if (FcPatternGetInteger(pattern, FC_SIZE, 0, &point_size) ==
+             FcResultMatch) {
+    printf(NAME_FORMAT "%d points\n", "requested size", point_size);
+  }
 
+  FcPattern* match = MatchFontconfigQuery(NULL, pattern);
   PrintFontconfigPattern(match, 1);
 
   FcPatternDestroy(pattern);
@@ -388,33 +788,5956 @@ void PrintXSettings() {
   printf("\n");
 }
 
-int main(int argc, char** argv) {
-  int opt;
-  int bold = 0, italic = 0;
-  const char* user_font_desc = NULL;
-  while ((opt = getopt(argc, argv, "bf:hi")) != -1) {
-    switch (opt) {
-      case 'b':
-        bold = 1;
-        break;
-      case 'f':
-        user_font_desc = optarg;
+// Maximum number of frames recorded per profiler sample.
+#define PROFILER_MAX_DEPTH 64
+
+// Maximum number of samples recorded by the profiler. Later samples are
+// dropped.
+#define PROFILER_MAX_SAMPLES (1 << 16)
+
+// Maximum number of threads that can be registered with the profiler.
+#define PROFILER_MAX_THREADS 256
+
+// Interval between samples of each thread's CPU time. 997 Hz rather than 1000
+// Hz avoids sampling in lockstep with periodic work.
+#define PROFILER_INTERVAL_NS (1000000000L / 997)
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// A stack captured by the profiler's SIGPROF handler.
+typedef struct {
+  int thread_index;
+  int depth;
+  void* frames[PROFILER_MAX_DEPTH];
+} ProfilerSample;
+
+// Profiler state. Samples are written to a preallocated buffer from the
+// signal handler and aggregated by ProfilerStop().
+ProfilerSample* profiler_samples = NULL;
+int profiler_num_samples = 0;
+int profiler_num_dropped = 0;
+int profiler_running = 0;
+timer_t profiler_timers[PROFILER_MAX_THREADS];
+int profiler_num_threads = 0;
+pthread_mutex_t profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread int profiler_thread_index = -1;
+
+void HandleProfilerSignal(int sig) {
+  if (!__atomic_load_n(&profiler_running, __ATOMIC_ACQUIRE))
+    return;
+  const int index = __atomic_fetch_add(&profiler_num_samples, 1,
+                                       __ATOMIC_RELAXED);
+  if (index >= PROFILER_MAX_SAMPLES) {
+    __atomic_fetch_add(&profiler_num_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  // backtrace() may clobber errno in the interrupted code.
+  const int saved_errno = errno;
+  ProfilerSample* sample = &profiler_samples[index];
+  sample->thread_index = profiler_thread_index;
+  const int depth = backtrace(sample->frames, PROFILER_MAX_DEPTH);
+  // Publish the depth last so ProfilerStop() never reads a half-written
+  // sample; slots a late signal never filled keep their zero depth.
+  __atomic_store_n(&sample->depth, depth, __ATOMIC_RELEASE);
+  errno = saved_errno;
+}
+
+// Starts sampling the calling thread's CPU time. Threads that do work while the
+// profiler is running should call this when they start. Does nothing if the
+// profiler isn't running.
+void ProfilerRegisterThread() {
+  if (!__atomic_load_n(&profiler_running, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&profiler_mutex);
+  if (profiler_num_threads < PROFILER_MAX_THREADS) {
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    timer_t* timer = &profiler_timers[profiler_num_threads];
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, timer) == 0) {
+      struct itimerspec spec;
+      memset(&spec, 0, sizeof(spec));
+      spec.it_interval.tv_nsec = PROFILER_INTERVAL_NS;
+      spec.it_value.tv_nsec = PROFILER_INTERVAL_NS;
+      timer_settime(*timer, 0, &spec, NULL);
+      profiler_thread_index = profiler_num_threads++;
+    } else {
+      perror("timer_create");
+    }
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+}
+
+// Starts the profiler and registers the calling thread.
+void ProfilerStart() {
+  assert(!profiler_running);
+  profiler_samples = calloc(PROFILER_MAX_SAMPLES, sizeof(ProfilerSample));
+  assert(profiler_samples);
+  profiler_num_samples = 0;
+  profiler_num_dropped = 0;
+
+  // backtrace() loads libgcc the first time that it's called, which isn't safe
+  // to do from a signal handler.
+  void* frame = NULL;
+  backtrace(&frame, 1);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = HandleProfilerSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  __atomic_store_n(&profiler_running, 1, __ATOMIC_RELEASE);
+  ProfilerRegisterThread();
+}
+
+// Appends a name for |address| to |str|, which has room for |size| bytes.
+void AppendFrameName(void* address, char* str, size_t size) {
+  Dl_info info;
+  const size_t len = strlen(str);
+  const int found = dladdr(address, &info) != 0;
+  if (found && info.dli_sname) {
+    snprintf(str + len, size - len, "%s", info.dli_sname);
+  } else if (found && info.dli_fname) {
+    const char* slash = strrchr(info.dli_fname, '/');
+    snprintf(str + len, size - len, "[%s]",
+             slash ? slash + 1 : info.dli_fname);
+  } else {
+    snprintf(str + len, size - len, "%p", address);
+  }
+}
+
+int CompareStrings(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Stops the profiler and writes the recorded stacks to |path| in the folded
+// format ("thread-0;main;Foo;Bar 12") accepted by flamegraph.pl and similar
+// tools.
+void ProfilerStop(const char* path) {
+  __atomic_store_n(&profiler_running, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&profiler_mutex);
+  for (int i = 0; i < profiler_num_threads; i++)
+    timer_delete(profiler_timers[i]);
+  profiler_num_threads = 0;
+  pthread_mutex_unlock(&profiler_mutex);
+  signal(SIGPROF, SIG_IGN);
+
+  const int num_samples = profiler_num_samples < PROFILER_MAX_SAMPLES ?
+      profiler_num_samples : PROFILER_MAX_SAMPLES;
+  char** stacks = calloc(num_samples + 1, sizeof(char*));
+  assert(stacks);
+  const size_t kStackSize = 4096;
+  int num_stacks = 0;
+  for (int i = 0; i < num_samples; i++) {
+    const ProfilerSample* sample = &profiler_samples[i];
+    if (__atomic_load_n(&sample->depth, __ATOMIC_ACQUIRE) == 0)
+      continue;
+    char* stack = malloc(kStackSize);
+    assert(stack);
+    stacks[num_stacks++] = stack;
+    snprintf(stack, kStackSize, "thread-%d", sample->thread_index);
+    // Skip the handler and signal trampoline frames, and print the remaining
+    // frames starting at the root. Return addresses point after the call, so
+    // subtract one to look up the calling function.
+    for (int j = sample->depth - 1; j >= 2; j--) {
+      strncat(stack, ";", kStackSize - strlen(stack) - 1);
+      AppendFrameName((char*) sample->frames[j] - 1, stack, kStackSize);
+    }
+  }
+  qsort(stacks, num_stacks, sizeof(char*), CompareStrings);
+
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+  } else {
+    int count = 0;
+    for (int i = 0; i < num_stacks; i++) {
+      count++;
+      if (!stacks[i + 1] || strcmp(stacks[i], stacks[i + 1]) != 0) {
+        fprintf(file, "%s %d\n", stacks[i], count);
+        count = 0;
+      }
+    }
+    fclose(file);
+  }
+  if (profiler_num_dropped > 0) {
+    fprintf(stderr, "Profiler dropped %d sample(s) after the first %d\n",
+            profiler_num_dropped, PROFILER_MAX_SAMPLES);
+  }
+
+  for (int i = 0; i < num_stacks; i++)
+    free(stacks[i]);
+  free(stacks);
+  free(profiler_samples);
+  profiler_samples = NULL;
+}
+
+// Options shared by all benchmark modes.
+typedef struct {
+  // CPUs that benchmark threads are pinned to, or an empty list to not pin.
+  int cpus[CPU_SETSIZE];
+  int num_cpus;
+
+  // Desired half-width of the 95% confidence interval, as a fraction of the
+  // mean.
+  double target_ci;
+
+  // Bounds on the number of samples that are taken.
+  int min_samples;
+  int max_samples;
+
+  // Minimum duration of each sample in seconds. Iteration counts are sized
+  // so that each sample takes at least this long.
+  double min_sample_sec;
+
+  // If non-NULL, raw per-iteration sample times are written here.
+  FILE* output;
+} BenchmarkOptions;
+
+// Summary of a benchmark run. Times are in nanoseconds per iteration.
+typedef struct {
+  int num_samples;
+  long iterations_per_sample;
+  double mean;
+  double median;
+  double stddev;
+  double ci;  // Half-width of the 95% confidence interval of the mean.
+  int num_outliers;
+  int num_freq_changes;  // Samples during which the CPU frequency changed.
+  int num_throttled;     // Samples discarded due to thermal throttling.
+} BenchmarkResult;
+
+typedef void (*BenchmarkFunc)(void* data);
+
+// Pins the calling thread to the |index|th CPU in |options|, wrapping around
+// if there are more threads than CPUs. Does nothing if no CPUs were chosen.
+void PinCurrentThread(const BenchmarkOptions* options, int index) {
+  if (options->num_cpus <= 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(options->cpus[index % options->num_cpus], &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    perror("sched_setaffinity");
+}
+
+// Reads a single integer from the sysfs file at |path|, returning -1 if it
+// is unavailable.
+long ReadSysfsLong(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return -1;
+  long value = -1;
+  if (fscanf(file, "%ld", &value) != 1)
+    value = -1;
+  fclose(file);
+  return value;
+}
+
+// Returns the current frequency of |cpu| in kHz, or -1 if unknown.
+long GetCpuFrequency(int cpu) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+  return ReadSysfsLong(path);
+}
+
+// Returns the number of times that |cpu|'s core has been thermally throttled,
+// or -1 if unknown.
+long GetCpuThrottleCount(int cpu) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/thermal_throttle/core_throttle_count",
+           cpu);
+  return ReadSysfsLong(path);
+}
+
+int CompareDoubles(const void* a, const void* b) {
+  const double da = *(const double*) a, db = *(const double*) b;
+  return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+// Returns the value at |fraction| (in [0, 1]) of the sorted array |values|,
+// interpolating between neighboring elements.
+double GetQuantile(const double* values, int num_values, double fraction) {
+  const double pos = fraction * (num_values - 1);
+  const int lower = (int) pos;
+  if (lower + 1 >= num_values)
+    return values[num_values - 1];
+  return values[lower] + (pos - lower) * (values[lower + 1] - values[lower]);
+}
+
+// Two-sided 95% quantiles of Student's t distribution for 1 to 30 degrees of
+// freedom.
+const double kStudentT95[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+// Returns the two-sided 95% quantile of Student's t distribution with
+// |df| degrees of freedom. Beyond the table, a Cornish-Fisher expansion around
+// the normal quantile is accurate to well under 0.1%.
+double GetStudentT95(int df) {
+  const int num_entries = sizeof(kStudentT95) / sizeof(*kStudentT95);
+  if (df <= num_entries)
+    return kStudentT95[df > 0 ? df - 1 : 0];
+  const double z = 1.959964, z3 = z * z * z, z5 = z3 * z * z;
+  return z + (z3 + z) / (4.0 * df) +
+      (5 * z5 + 16 * z3 + 3 * z) / (96.0 * df * df);
+}
+
+// Fills in the statistics in |result| from its |num_samples| |samples|.
+void ComputeBenchmarkStats(const double* samples, BenchmarkResult* result) {
+  const int n = result->num_samples;
+  double sum = 0.0;
+  for (int i = 0; i < n; i++)
+    sum += samples[i];
+  result->mean = sum / n;
+
+  double sum_squares = 0.0;
+  for (int i = 0; i < n; i++)
+    sum_squares += (samples[i] - result->mean) * (samples[i] - result->mean);
+  result->stddev = n > 1 ? sqrt(sum_squares / (n - 1)) : 0.0;
+  result->ci =
+      n > 1 ? GetStudentT95(n - 1) * result->stddev / sqrt(n) : result->mean;
+
+  double* sorted = malloc(n * sizeof(double));
+  assert(sorted);
+  memcpy(sorted, samples, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), CompareDoubles);
+  result->median = GetQuantile(sorted, n, 0.5);
+
+  // Count samples outside of Tukey's fences.
+  const double q1 = GetQuantile(sorted, n, 0.25);
+  const double q3 = GetQuantile(sorted, n, 0.75);
+  const double iqr = q3 - q1;
+  result->num_outliers = 0;
+  for (int i = 0; i < n; i++) {
+    if (sorted[i] < q1 - 1.5 * iqr || sorted[i] > q3 + 1.5 * iqr)
+      result->num_outliers++;
+  }
+  free(sorted);
+}
+
+// Runs |func| |iterations| times on the current CPU and returns the elapsed
+// time in nanoseconds. Sets |freq_changed| and |throttled| if the CPU's
+// frequency or throttle count changed while running.
+double RunBenchmarkSample(BenchmarkFunc func,
+                          void* data,
+                          long iterations,
+                          int* freq_changed,
+                          int* throttled) {
+  const int cpu = sched_getcpu();
+  const long start_freq = GetCpuFrequency(cpu);
+  const long start_throttle = GetCpuThrottleCount(cpu);
+  const double start = GetTimeNs();
+  for (long i = 0; i < iterations; i++)
+    func(data);
+  const double elapsed = GetTimeNs() - start;
+
+  // Treat frequency changes of less than 5% as noise from the governor's
+  // sampling.
+  const long end_freq = GetCpuFrequency(cpu);
+  *freq_changed = sched_getcpu() != cpu ||
+      (start_freq > 0 && end_freq > 0 &&
+       labs(end_freq - start_freq) * 20 > start_freq);
+  *throttled = start_throttle >= 0 &&
+      GetCpuThrottleCount(cpu) != start_throttle;
+  return elapsed;
+}
+
+// Runs the benchmark |func| and fills |result|. Returns the samples, which are
+// per-iteration times in nanoseconds and must be freed with free().
+double* RunBenchmark(const BenchmarkOptions* options,
+                     const char* name,
+                     BenchmarkFunc func,
+                     void* data,
+                     BenchmarkResult* result) {
+  PinCurrentThread(options, 0);
+  memset(result, 0, sizeof(*result));
+
+  // Warm up (e.g. letting Fontconfig load its caches) and then double the
+  // iteration count until a sample is long enough.
+  func(data);
+  int freq_changed = 0, throttled = 0;
+  long iterations = 1;
+  while (RunBenchmarkSample(func, data, iterations, &freq_changed,
+                            &throttled) < options->min_sample_sec * 1e9 &&
+         iterations < (1L << 30)) {
+    iterations *= 2;
+  }
+  result->iterations_per_sample = iterations;
+
+  double* samples = malloc(options->max_samples * sizeof(double));
+  assert(samples);
+  while (result->num_samples < options->max_samples) {
+    const double elapsed = RunBenchmarkSample(func, data, iterations,
+                                              &freq_changed, &throttled);
+    if (throttled) {
+      result->num_throttled++;
+      if (result->num_throttled > options->max_samples)
         break;
-      case 'i':
-        italic = 1;
+      continue;
+    }
+    if (freq_changed)
+      result->num_freq_changes++;
+    samples[result->num_samples++] = elapsed / iterations;
+
+    if (result->num_samples >= options->min_samples) {
+      ComputeBenchmarkStats(samples, result);
+      if (result->ci <= options->target_ci * result->mean)
         break;
-      default:
-        fprintf(stderr,
-                "Usage: %s [options]\n"
-                "\n"
-                "Options:\n"
-                "  -b       Request bold font from Fontconfig\n"
-                "  -f DESC  Specify Pango font description for Fontconfig\n"
-                "  -i       Request italic font from Fontconfig\n",
-                argv[0]);
-        return 1;
     }
   }
+  if (result->num_samples > 0)
+    ComputeBenchmarkStats(samples, result);
+
+  if (options->output) {
+    for (int i = 0; i < result->num_samples; i++)
+      fprintf(options->output, "%s %.1f\n", name, samples[i]);
+    fflush(options->output);
+  }
+  return samples;
+}
+
+// Prints |ns| using an appropriate unit.
+void PrintDuration(const char* name, double ns) {
+  char str[32];
+  FormatDuration(ns, str, sizeof(str));
+  printf(NAME_FORMAT "%s\n", name, str);
+}
+
+void PrintBenchmarkResult(const char* name, const BenchmarkResult* result) {
+  printf("Benchmark (%s):\n", name);
+  if (result->num_samples == 0) {
+    printf("[no samples]\n\n");
+    return;
+  }
+  printf(NAME_FORMAT "%d x %ld\n", "samples", result->num_samples,
+         result->iterations_per_sample);
+  PrintDuration("mean", result->mean);
+  PrintDuration("median", result->median);
+  PrintDuration("stddev", result->stddev);
+  printf(NAME_FORMAT "+/-%.2f%%\n", "95% CI",
+         100.0 * result->ci / result->mean);
+  printf(NAME_FORMAT "%d\n", "outliers", result->num_outliers);
+  printf(NAME_FORMAT "%d\n", "freq changes", result->num_freq_changes);
+  printf(NAME_FORMAT "%d (discarded)\n", "throttled samples",
+         result->num_throttled);
+  printf("\n");
+}
+
+// Runs |func| via RunBenchmark() and prints the results.
+void RunAndPrintBenchmark(const BenchmarkOptions* options,
+                          const char* name,
+                          BenchmarkFunc func,
+                          void* data) {
+  BenchmarkResult result;
+  free(RunBenchmark(options, name, func, data, &result));
+  PrintBenchmarkResult(name, &result);
+}
+
+void RunMatchBenchmarkIteration(void* data) {
+  FcPattern* query = FcPatternDuplicate((FcPattern*) data);
+  FcPatternDestroy(MatchFontconfigQuery(NULL, query));
+  FcPatternDestroy(query);
+}
+
+void RunStartupBenchmarkIteration(void* data) {
+  FcConfig* config = FcInitLoadConfigAndFonts();
+  assert(config);
+  FcConfigDestroy(config);
+}
+
+// Characters rasterized by the render benchmark.
+const char kRenderBenchmarkText[] =
+    "The quick brown fox jumps over the lazy dog. 0123456789";
+
+// State used by the render benchmark.
+typedef struct {
+  FT_Face face;
+  FT_Int32 load_flags;
+  FT_Render_Mode render_mode;
+} RenderBenchmarkData;
+
+// Loads the glyph for |ch| from |face| with |load_flags| and renders it with
+// |render_mode|. Returns false on failure.
+int RenderGlyph(FT_Face face,
+                FT_ULong ch,
+                FT_Int32 load_flags,
+                FT_Render_Mode render_mode) {
+  return FT_Load_Char(face, ch, load_flags) == 0 &&
+      FT_Render_Glyph(face->glyph, render_mode) == 0;
+}
+
+void RunRenderBenchmarkIteration(void* data) {
+  const RenderBenchmarkData* render = (const RenderBenchmarkData*) data;
+  for (const char* ch = kRenderBenchmarkText; *ch; ch++)
+    RenderGlyph(render->face, *ch, render->load_flags, render->render_mode);
+}
+
+// Returns FreeType load flags corresponding to the rendering settings in
+// |match|, which pick the hinting target as cairo does: hintslight hints
+// lightly even for subpixel rendering. Glyphs are rendered separately with
+// GetFreeTypeRenderMode().
+FT_Int32 GetFreeTypeLoadFlags(FcPattern* match) {
+  FcBool antialias = FcTrue, hinting = FcTrue, autohint = FcFalse;
+  int hint_style = FC_HINT_FULL, rgba = FC_RGBA_UNKNOWN;
+  FcPatternGetBool(match, FC_ANTIALIAS, 0, &antialias);
+  FcPatternGetBool(match, FC_HINTING, 0, &hinting);
+  FcPatternGetBool(match, FC_AUTOHINT, 0, &autohint);
+  FcPatternGetInteger(match, FC_HINT_STYLE, 0, &hint_style);
+  FcPatternGetInteger(match, FC_RGBA, 0, &rgba);
+
+  FT_Int32 flags = FT_LOAD_DEFAULT;
+  if (!hinting || hint_style == FC_HINT_NONE)
+    flags |= FT_LOAD_NO_HINTING;
+  if (autohint)
+    flags |= FT_LOAD_FORCE_AUTOHINT;
+
+  if (!antialias)
+    flags |= FT_LOAD_TARGET_MONO;
+  else if (hint_style == FC_HINT_SLIGHT)
+    flags |= FT_LOAD_TARGET_LIGHT;
+  else if (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR)
+    flags |= FT_LOAD_TARGET_LCD;
+  else if (rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR)
+    flags |= FT_LOAD_TARGET_LCD_V;
+  else
+    flags |= FT_LOAD_TARGET_NORMAL;
+  return flags;
+}
+
+// Returns the FreeType render mode corresponding to the antialiasing and
+// subpixel order in |match|.
+FT_Render_Mode GetFreeTypeRenderMode(FcPattern* match) {
+  FcBool antialias = FcTrue;
+  int rgba = FC_RGBA_UNKNOWN;
+  FcPatternGetBool(match, FC_ANTIALIAS, 0, &antialias);
+  FcPatternGetInteger(match, FC_RGBA, 0, &rgba);
+  if (!antialias)
+    return FT_RENDER_MODE_MONO;
+  if (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR)
+    return FT_RENDER_MODE_LCD;
+  if (rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR)
+    return FT_RENDER_MODE_LCD_V;
+  return FT_RENDER_MODE_NORMAL;
+}
+
+// Benchmark modes that can be requested via -B.
+enum {
+  BENCHMARK_MATCH = 1 << 0,
+  BENCHMARK_STARTUP = 1 << 1,
+  BENCHMARK_RENDER = 1 << 2,
+};
+
+// Returns the BENCHMARK_* value named by |name|, or 0 if it is unknown.
+int GetBenchmarkMode(const char* name) {
+  if (strcmp(name, "match") == 0)
+    return BENCHMARK_MATCH;
+  if (strcmp(name, "startup") == 0)
+    return BENCHMARK_STARTUP;
+  if (strcmp(name, "render") == 0)
+    return BENCHMARK_RENDER;
+  return 0;
+}
+
+// Parses a comma-separated list of CPU numbers from |str| into |options|.
+// Returns false on error.
+int ParseBenchmarkCpus(const char* str, BenchmarkOptions* options) {
+  options->num_cpus = 0;
+  while (*str) {
+    char* end = NULL;
+    const long cpu = strtol(str, &end, 10);
+    if (end == str || cpu < 0 || cpu >= CPU_SETSIZE ||
+        options->num_cpus >= CPU_SETSIZE)
+      return 0;
+    options->cpus[options->num_cpus++] = cpu;
+    str = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      return 0;
+  }
+  return options->num_cpus > 0;
+}
+
+// Runs the benchmarks in the |modes| bitfield against the font described by
+// |desc|.
+void RunBenchmarks(const BenchmarkOptions* options,
+                   int modes,
+                   const PangoFontDescription* desc,
+                   int bold,
+                   int italic) {
+  FcPattern* query = CreateFontconfigQuery(desc, bold, italic);
+
+  if (modes & BENCHMARK_MATCH)
+    RunAndPrintBenchmark(options, "match", RunMatchBenchmarkIteration, query);
+
+  if (modes & BENCHMARK_STARTUP)
+    RunAndPrintBenchmark(options, "startup", RunStartupBenchmarkIteration,
+                         NULL);
+
+  if (modes & BENCHMARK_RENDER) {
+    FcPattern* render_query = FcPatternDuplicate(query);
+    FcPattern* match = MatchFontconfigQuery(NULL, render_query);
+    FcPatternDestroy(render_query);
+    FcChar8* file = NULL;
+    int index = 0;
+    double pixel_size = 0.0;
+    FcPatternGetString(match, FC_FILE, 0, &file);
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &pixel_size);
+
+    FT_Library library;
+    RenderBenchmarkData data;
+    const int have_library = FT_Init_FreeType(&library) == 0;
+    if (!have_library || !file ||
+        FT_New_Face(library, (const char*) file, index, &data.face) != 0) {
+      printf("Benchmark (render):\n[failed to load %s]\n\n",
+             file ? (const char*) file : "font");
+    } else {
+      FT_Set_Pixel_Sizes(data.face, 0, pixel_size > 0 ? pixel_size : 16);
+      data.load_flags = GetFreeTypeLoadFlags(match);
+      data.render_mode = GetFreeTypeRenderMode(match);
+      RunAndPrintBenchmark(options, "render", RunRenderBenchmarkIteration,
+                           &data);
+      FT_Done_Face(data.face);
+    }
+    if (have_library)
+      FT_Done_FreeType(library);
+    FcPatternDestroy(match);
+  }
+
+  FcPatternDestroy(query);
+}
+
+// Counter incremented by the allocator wrappers below, which interpose on
+// glibc's allocator for the whole process (including Fontconfig and FreeType)
+// so that --batch can measure per-query allocations. The wrappers rely on
+// glibc's __libc_* entry points. Nothing is counted, and no atomic operations
+// are done, unless |counting_allocations| is set.
+int counting_allocations = 0;
+long num_allocations = 0;
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+
+void CountAllocation() {
+  if (counting_allocations)
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+  CountAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) {
+  CountAllocation();
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  CountAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* reallocarray(void* ptr, size_t num, size_t size) {
+  if (size && num > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  CountAllocation();
+  return __libc_realloc(ptr, num * size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  CountAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)))
+    return EINVAL;
+  CountAllocation();
+  void* result = __libc_memalign(alignment, size);
+  if (!result)
+    return ENOMEM;
+  *ptr = result;
+  return 0;
+}
+
+void* valloc(size_t size) {
+  CountAllocation();
+  return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size) {
+  CountAllocation();
+  return __libc_pvalloc(size);
+}
+
+long GetNumAllocations() {
+  return __atomic_load_n(&num_allocations, __ATOMIC_RELAXED);
+}
+
+// Font request parsed from a Pango-style description like
+// "DejaVu Sans Bold Italic 10" or "Monospace 13px".
+typedef struct {
+  char family[128];
+  double size;
+  int size_is_absolute;
+  int weight;  // FC_WEIGHT_*, or -1 if unspecified.
+  int slant;   // FC_SLANT_*, or -1 if unspecified.
+} FontQuery;
+
+// Style words recognized by ParseFontQuery().
+const struct {
+  const char* name;
+  int weight;
+  int slant;
+} kFontQueryStyles[] = {
+  { "thin", FC_WEIGHT_THIN, -1 },
+  { "ultra-light", FC_WEIGHT_ULTRALIGHT, -1 },
+  { "light", FC_WEIGHT_LIGHT, -1 },
+  { "book", FC_WEIGHT_BOOK, -1 },
+  { "medium", FC_WEIGHT_MEDIUM, -1 },
+  { "semi-bold", FC_WEIGHT_DEMIBOLD, -1 },
+  { "bold", FC_WEIGHT_BOLD, -1 },
+  { "ultra-bold", FC_WEIGHT_ULTRABOLD, -1 },
+  { "heavy", FC_WEIGHT_HEAVY, -1 },
+  { "italic", -1, FC_SLANT_ITALIC },
+  { "oblique", -1, FC_SLANT_OBLIQUE },
+};
+
+// Parses |str| (which may end in a newline) into |query| without allocating
+// memory. Trailing style words and sizes are consumed from the end; whatever
+// precedes them is the family. Returns false if no family is present.
+int ParseFontQuery(const char* str, FontQuery* query) {
+  while (*str == ' ' || *str == '\t')
+    str++;
+  size_t len = strcspn(str, "\r\n");
+  query->size = 10.0;
+  query->size_is_absolute = 0;
+  query->weight = -1;
+  query->slant = -1;
+
+  int parsed_size = 0;
+  while (len > 0) {
+    while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == ','))
+      len--;
+    size_t word_start = len;
+    while (word_start > 0 && str[word_start - 1] != ' ')
+      word_start--;
+    if (word_start == 0)
+      break;
+    const char* word = str + word_start;
+    const size_t word_len = len - word_start;
+
+    int consumed = 0;
+    if (!parsed_size && word_len > 0 && (word[0] == '.' ||
+                                         (word[0] >= '0' && word[0] <= '9'))) {
+      char* end = NULL;
+      const double size = strtod(word, &end);
+      const size_t num_len = end - word;
+      if (num_len == word_len ||
+          (num_len + 2 == word_len && strncmp(end, "px", 2) == 0)) {
+        query->size = size;
+        query->size_is_absolute = num_len != word_len;
+        parsed_size = consumed = 1;
+      }
+    }
+    for (size_t i = 0;
+         !consumed && i < sizeof(kFontQueryStyles) / sizeof(*kFontQueryStyles);
+         i++) {
+      if (strlen(kFontQueryStyles[i].name) == word_len &&
+          strncasecmp(word, kFontQueryStyles[i].name, word_len) == 0) {
+        if (kFontQueryStyles[i].weight >= 0)
+          query->weight = kFontQueryStyles[i].weight;
+        if (kFontQueryStyles[i].slant >= 0)
+          query->slant = kFontQueryStyles[i].slant;
+        consumed = 1;
+      }
+    }
+    if (!consumed)
+      break;
+    len = word_start;
+  }
+  while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == ','))
+    len--;
+  if (len == 0 || len >= sizeof(query->family))
+    return 0;
+  memcpy(query->family, str, len);
+  query->family[len] = '\0';
+  return 1;
+}
+
+// Adds the properties requested by |query| to |pattern|.
+void AddFontQueryToPattern(const FontQuery* query, FcPattern* pattern) {
+  FcPatternAddString(pattern, FC_FAMILY, (const FcChar8*) query->family);
+  FcPatternAddDouble(pattern,
+                     query->size_is_absolute ? FC_PIXEL_SIZE : FC_SIZE,
+                     query->size);
+  if (query->weight >= 0)
+    FcPatternAddInteger(pattern, FC_WEIGHT, query->weight);
+  if (query->slant >= 0)
+    FcPatternAddInteger(pattern, FC_SLANT, query->slant);
+}
+
+// Fixed-size buffer that batch output is formatted into before being written
+// in a single call.
+typedef struct {
+  char* data;
+  size_t size;
+  size_t used;
+} OutputArena;
+
+// Appends formatted text to |arena|. Returns false if it doesn't fit, in which
+// case |arena| is unchanged.
+int ArenaPrintf(OutputArena* arena, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  const int len = vsnprintf(arena->data + arena->used,
+                            arena->size - arena->used, format, args);
+  va_end(args);
+  if (len < 0 || (size_t) len >= arena->size - arena->used) {
+    arena->data[arena->used] = '\0';
+    return 0;
+  }
+  arena->used += len;
+  return 1;
+}
+
+// Writes |arena|'s contents to |fd| and empties it.
+void FlushArena(OutputArena* arena, int fd) {
+  size_t written = 0;
+  while (written < arena->used) {
+    const ssize_t len = write(fd, arena->data + written,
+                              arena->used - written);
+    if (len < 0) {
+      perror("write");
+      break;
+    }
+    written += len;
+  }
+  arena->used = 0;
+}
+
+// Sizes of the buffers used to read batch input and format batch output.
+#define BATCH_INPUT_SIZE (64 * 1024)
+#define BATCH_OUTPUT_SIZE (256 * 1024)
+
+// Number of entries in BatchState's result cache. Must be a power of two.
+#define BATCH_CACHE_SIZE 4096
+
+// Cached result for a batch query. Longer results, e.g. for fonts with deep
+// paths, are answered without being cached.
+typedef struct {
+  char query[128];
+  char result[384];
+} BatchCacheEntry;
+
+// Size of the buffer that a batch result line is formatted into.
+#define BATCH_MAX_RESULT (PATH_MAX + 1024)
+
+// State reused across batch queries so that answering a repeated query doesn't
+// allocate memory.
+typedef struct {
+  // Config that queries are matched against, or NULL for the current config.
+  FcConfig* config;
+
+  // Pattern that queries are built in. It's cleared rather than destroyed
+  // between queries so that its element array keeps its size, although
+  // Fontconfig still allocates the values added to it. Only cache hits are
+  // free of allocations.
+  FcPattern* pattern;
+
+  // Open-addressed cache of formatted results keyed by query string.
+  BatchCacheEntry* cache;
+  int cache_size;
+
+  int num_queries;
+  int num_cache_hits;
+} BatchState;
+
+void InitBatchState(BatchState* state) {
+  memset(state, 0, sizeof(*state));
+  state->pattern = FcPatternCreate();
+  assert(state->pattern);
+  state->cache = calloc(BATCH_CACHE_SIZE, sizeof(BatchCacheEntry));
+  assert(state->cache);
+}
+
+void ClearBatchCache(BatchState* state) {
+  memset(state->cache, 0, BATCH_CACHE_SIZE * sizeof(BatchCacheEntry));
+  state->cache_size = 0;
+}
+
+void DestroyBatchState(BatchState* state) {
+  FcPatternDestroy(state->pattern);
+  free(state->cache);
+}
+
+// Removes all elements from |pattern| while keeping its storage.
+void ClearFcPattern(FcPattern* pattern) {
+  FcPatternIter iter;
+  for (FcPatternIterStart(pattern, &iter);
+       FcPatternIterIsValid(pattern, &iter);
+       FcPatternIterStart(pattern, &iter)) {
+    FcPatternDel(pattern, FcPatternIterGetObject(pattern, &iter));
+  }
+}
+
+// Number of tab-separated fields in a result line from FormatBatchResult().
+#define BATCH_RESULT_FIELDS 9
+
+// Formats |match| as a tab-separated result line into |str|. Returns false if
+// it doesn't fit, in which case |str| isn't a complete line.
+int FormatBatchResult(const char* query,
+                      FcPattern* match,
+                      char* str,
+                      size_t size) {
+  FcChar8* family = NULL;
+  FcChar8* style = NULL;
+  FcChar8* file = NULL;
+  int index = 0, hint_style = -1, rgba = FC_RGBA_UNKNOWN;
+  double pixel_size = 0.0;
+  FcBool antialias = -1, hinting = -1;
+  FcPatternGetString(match, FC_FAMILY, 0, &family);
+  FcPatternGetString(match, FC_STYLE, 0, &style);
+  FcPatternGetString(match, FC_FILE, 0, &file);
+  FcPatternGetInteger(match, FC_INDEX, 0, &index);
+  FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &pixel_size);
+  FcPatternGetBool(match, FC_ANTIALIAS, 0, &antialias);
+  FcPatternGetBool(match, FC_HINTING, 0, &hinting);
+  FcPatternGetInteger(match, FC_HINT_STYLE, 0, &hint_style);
+  FcPatternGetInteger(match, FC_RGBA, 0, &rgba);
+  const int len =
+      snprintf(str, size, "%s\t%s\t%s\t%s:%d\t%.2f\t%d\t%d\t%s\t%s\n",
+               query, family ? (const char*) family : "",
+               style ? (const char*) style : "",
+               file ? (const char*) file : "", index, pixel_size, antialias,
+               hinting, GetFontconfigHintStyleString(hint_style),
+               GetFontconfigRgbaString(rgba));
+  return len >= 0 && (size_t) len < size;
+}
+
+// Returns the entry in |state|'s cache for |query|, which is either the entry
+// already holding |query| or an empty one that it can be stored in. The cache
+// is cleared if it's full.
+BatchCacheEntry* FindBatchCacheEntry(BatchState* state, const char* query) {
+  // FNV-1a hash with linear probing.
+  uint32_t hash = 2166136261u;
+  for (const char* ch = query; *ch; ch++)
+    hash = (hash ^ (unsigned char) *ch) * 16777619u;
+  for (int i = 0; i < BATCH_CACHE_SIZE; i++) {
+    BatchCacheEntry* entry = &state->cache[(hash + i) & (BATCH_CACHE_SIZE - 1)];
+    if (!entry->query[0] || strcmp(entry->query, query) == 0)
+      return entry;
+  }
+  ClearBatchCache(state);
+  return &state->cache[hash & (BATCH_CACHE_SIZE - 1)];
+}
+
+// Matches the font described by |line| and appends a result line to |arena|.
+// Returns false if |arena| is too full to hold the result.
+int HandleBatchQuery(BatchState* state, const char* line, OutputArena* arena) {
+  const size_t len = strcspn(line, "\r\n");
+  if (len == 0)
+    return 1;
+
+  char query_string[sizeof(((BatchCacheEntry*) NULL)->query)];
+  BatchCacheEntry* entry = NULL;
+  if (len < sizeof(query_string)) {
+    memcpy(query_string, line, len);
+    query_string[len] = '\0';
+    entry = FindBatchCacheEntry(state, query_string);
+    if (entry->query[0]) {
+      if (!ArenaPrintf(arena, "%s", entry->result))
+        return 0;
+      state->num_queries++;
+      state->num_cache_hits++;
+      return 1;
+    }
+  }
+
+  char result[BATCH_MAX_RESULT];
+  FontQuery query;
+  const size_t query_len = len < sizeof(query_string) ?
+      len : sizeof(query_string) - 1;
+  snprintf(query_string, sizeof(query_string), "%.*s", (int) query_len, line);
+  int valid = ParseFontQuery(line, &query);
+  if (valid) {
+    FcPattern* pattern = state->pattern;
+    ClearFcPattern(pattern);
+    AddFontQueryToPattern(&query, pattern);
+    FcPattern* match = MatchFontconfigQuery(state->config, pattern);
+    valid = FormatBatchResult(query_string, match, result, sizeof(result));
+    FcPatternDestroy(match);
+  }
+  if (!valid)
+    snprintf(result, sizeof(result), "%s\t[invalid]\n", query_string);
+
+  if (!ArenaPrintf(arena, "%s", result))
+    return 0;
+  if (entry && strlen(result) < sizeof(entry->result)) {
+    strcpy(entry->query, query_string);
+    strcpy(entry->result, result);
+    state->cache_size++;
+  }
+  state->num_queries++;
+  return 1;
+}
+
+// Reads font descriptions from stdin, one per line, and writes a result line
+// for each to stdout. Each read() from stdin is handled as a batch whose output
+// is formatted into a single arena and written at once. Statistics, including
+// the number of allocations per query after the first batch, are written to
+// stderr. Cache misses allocate inside Fontconfig, so the allocation count is
+// only zero for workloads that repeat.
+void RunBatch() {
+  BatchState state;
+  InitBatchState(&state);
+
+  char* input = malloc(BATCH_INPUT_SIZE);
+  assert(input);
+  OutputArena arena = { malloc(BATCH_OUTPUT_SIZE), BATCH_OUTPUT_SIZE, 0 };
+  assert(arena.data);
+
+  counting_allocations = 1;
+  size_t input_len = 0;
+  int num_batches = 0;
+  long warm_allocations = 0;
+  int warm_queries = 0;
+  ssize_t len = 0;
+  while ((len = read(STDIN_FILENO, input + input_len,
+                     BATCH_INPUT_SIZE - input_len - 1)) > 0 ||
+         input_len > 0) {
+    if (len > 0)
+      input_len += len;
+    input[input_len] = '\0';
+
+    // Handle complete lines, plus the final unterminated line at EOF or when
+    // it fills the buffer.
+    char* line = input;
+    char* newline = NULL;
+    while ((newline = strchr(line, '\n')) ||
+           (*line && (len <= 0 || input_len == BATCH_INPUT_SIZE - 1))) {
+      if (!HandleBatchQuery(&state, line, &arena)) {
+        FlushArena(&arena, STDOUT_FILENO);
+        HandleBatchQuery(&state, line, &arena);
+      }
+      line = newline ? newline + 1 : line + strlen(line);
+    }
+    input_len -= line - input;
+    memmove(input, line, input_len);
+    FlushArena(&arena, STDOUT_FILENO);
+
+    if (++num_batches == 1) {
+      warm_allocations = GetNumAllocations();
+      warm_queries = state.num_queries;
+    }
+    if (len <= 0)
+      break;
+  }
+
+  const int steady_queries = state.num_queries - warm_queries;
+  counting_allocations = 0;
+  fprintf(stderr, "%d queries in %d batch(es), %d cache hits\n",
+          state.num_queries, num_batches, state.num_cache_hits);
+  if (steady_queries > 0) {
+    fprintf(stderr, "%.2f allocations per query after the first batch\n",
+            (double) (GetNumAllocations() - warm_allocations) / steady_queries);
+  }
+
+  free(input);
+  free(arena.data);
+  DestroyBatchState(&state);
+}
+
+// Maximum number of clients connected to the daemon at once.
+#define DAEMON_MAX_CLIENTS 64
+
+// Size of each daemon client's request buffer. Longer lines are answered with
+// kDaemonInvalidResponse.
+#define DAEMON_CLIENT_BUFFER_SIZE 4096
+
+// Response to a request too long for the daemon's buffer.
+const char kDaemonInvalidResponse[] = "\t[invalid]\n";
+
+// Amount of unsent output at which the daemon stops reading a client's
+// requests until the client reads its responses.
+#define DAEMON_MAX_PENDING_OUTPUT (1024 * 1024)
+
+// First file descriptor passed by socket activation (SD_LISTEN_FDS_START).
+#define LISTEN_FDS_START 3
+
+// Minimum interval between the daemon's checks for config changes.
+#define DAEMON_CONFIG_CHECK_INTERVAL_SEC 5
+
+// Writes the home directory of |uid| to |home|. Returns false if it has none or
+// it doesn't fit.
+int GetUserHome(uid_t uid, char* home, size_t size) {
+  struct passwd pw;
+  struct passwd* result = NULL;
+  char buf[4096];
+  if (getpwuid_r(uid, &pw, buf, sizeof(buf), &result) != 0 || !result ||
+      !pw.pw_dir[0])
+    return 0;
+  return (size_t) snprintf(home, size, "%s", pw.pw_dir) < size;
+}
+
+// Set by HandleDaemonSignal() to make RunDaemon() exit.
+volatile sig_atomic_t daemon_stopping = 0;
+
+void HandleDaemonSignal(int sig) {
+  daemon_stopping = 1;
+}
+
+// A client connected to the daemon. Its socket is non-blocking, and responses
+// that it hasn't read yet wait in |out|.
+typedef struct {
+  int fd;
+  // Context that all of the peer's requests are answered from, or an empty
+  // string if it runs as the daemon's user and may name its own contexts.
+  // Other users get the context for their home directory, since contexts load
+  // configs from arbitrary paths.
+  char peer_context[PATH_MAX + 16];
+  char buf[DAEMON_CLIENT_BUFFER_SIZE];
+  size_t len;
+  // Whether the rest of an over-long request is being skipped.
+  int discarding;
+  char* out;
+  size_t out_len;
+  size_t out_capacity;
+} DaemonClient;
+
+// Sets |client|'s peer context from the credentials of its peer. Peers whose
+// credentials or home directory can't be found get "home=/", which has no
+// per-user fonts.
+void InitDaemonPeerContext(DaemonClient* client) {
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  char home[PATH_MAX];
+  if (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0)
+    cred.uid = (uid_t) -1;
+  if (cred.uid == getuid()) {
+    client->peer_context[0] = '\0';
+  } else if (cred.uid != (uid_t) -1 &&
+             GetUserHome(cred.uid, home, sizeof(home))) {
+    snprintf(client->peer_context, sizeof(client->peer_context), "home=%s",
+             home);
+  } else {
+    strcpy(client->peer_context, "home=/");
+  }
+}
+
+// Appends |len| bytes of |data| to |client|'s unsent output.
+void QueueDaemonOutput(DaemonClient* client, const char* data, size_t len) {
+  if (client->out_len + len > client->out_capacity) {
+    size_t capacity = client->out_capacity ? client->out_capacity : 4096;
+    while (capacity < client->out_len + len)
+      capacity *= 2;
+    client->out = realloc(client->out, capacity);
+    assert(client->out);
+    client->out_capacity = capacity;
+  }
+  memcpy(client->out + client->out_len, data, len);
+  client->out_len += len;
+}
+
+// Writes as much of |client|'s unsent output as its socket accepts. Returns
+// false if the client has disconnected.
+int FlushDaemonOutput(DaemonClient* client) {
+  size_t written = 0;
+  while (written < client->out_len) {
+    const ssize_t len = send(client->fd, client->out + written,
+                             client->out_len - written, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return 0;
+    }
+    written += len;
+  }
+  client->out_len -= written;
+  memmove(client->out, client->out + written, client->out_len);
+  return 1;
+}
+
+// Queues a control line with the daemon's config generation for |client|.
+void SendDaemonGeneration(DaemonClient* client, long generation) {
+  char line[64];
+  const int len = snprintf(line, sizeof(line),
+                           FONT_CONFIG_GENERATION_PREFIX "%ld\n", generation);
+  QueueDaemonOutput(client, line, len);
+}
+
+// Returns the listening socket passed via systemd-style socket activation, or
+// -1 if none was passed.
+int GetActivatedSocket() {
+  const char* pid = getenv("LISTEN_PID");
+  const char* fds = getenv("LISTEN_FDS");
+  if (!pid || !fds || atol(pid) != getpid() || atoi(fds) < 1)
+    return -1;
+  if (atoi(fds) > 1)
+    fprintf(stderr, "Ignoring all but the first of %s passed sockets\n", fds);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+  return LISTEN_FDS_START;
+}
+
+// Creates a Unix socket listening at |path|, replacing any stale socket file.
+// Returns -1 on failure, including if |path| exists and isn't a socket.
+int CreateListeningSocket(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Returns true if any of |config|'s config files or font directories have been
+// modified since |since|.
+int FontconfigChangedSince(FcConfig* config, time_t since) {
+  FcStrList* lists[2] = {
+    FcConfigGetConfigFiles(config),
+    FcConfigGetFontDirs(config),
+  };
+  int changed = 0;
+  for (int i = 0; i < 2; i++) {
+    FcChar8* path = NULL;
+    while (!changed && (path = FcStrListNext(lists[i]))) {
+      struct stat st;
+      changed = stat((const char*) path, &st) == 0 && st.st_mtime >= since;
+    }
+    FcStrListDone(lists[i]);
+  }
+  return changed;
+}
+
+// Loads the cached queries saved by SaveDaemonState() from |path| into
+// |state|. If the config has changed since the file was written, the queries
+// are matched again instead of trusting the saved results. Returns the number
+// of queries loaded.
+int LoadDaemonState(BatchState* state, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+  struct stat st;
+  const int stale = fstat(fileno(file), &st) != 0 ||
+      FontconfigChangedSince(NULL, st.st_mtime);
+
+  char arena_data[sizeof(((BatchCacheEntry*) NULL)->result)];
+  OutputArena arena = { arena_data, sizeof(arena_data), 0 };
+  char line[sizeof(((BatchCacheEntry*) NULL)->result)];
+  int num_loaded = 0;
+  while (fgets(line, sizeof(line), file)) {
+    // Skip the rest of lines too long to be results, and a last line that was
+    // cut short.
+    if (!strchr(line, '\n')) {
+      int ch = 0;
+      while ((ch = fgetc(file)) != EOF && ch != '\n') {}
+      continue;
+    }
+    const size_t query_len = strcspn(line, "\t\n");
+    if (query_len == 0 ||
+        query_len >= sizeof(((BatchCacheEntry*) NULL)->query) ||
+        line[query_len] != '\t')
+      continue;
+    int num_fields = 1;
+    for (const char* ch = line; *ch; ch++)
+      num_fields += *ch == '\t';
+    if (num_fields != BATCH_RESULT_FIELDS &&
+        strcmp(line + query_len, "\t[invalid]\n") != 0)
+      continue;
+    char query[sizeof(((BatchCacheEntry*) NULL)->query)];
+    memcpy(query, line, query_len);
+    query[query_len] = '\0';
+    if (stale) {
+      HandleBatchQuery(state, query, &arena);
+      arena.used = 0;
+    } else {
+      BatchCacheEntry* entry = FindBatchCacheEntry(state, query);
+      if (!entry->query[0])
+        state->cache_size++;
+      strcpy(entry->query, query);
+      strcpy(entry->result, line);
+    }
+    num_loaded++;
+  }
+  fclose(file);
+  return num_loaded;
+}
+
+// Writes |state|'s cached results to |path| so that a later daemon can start
+// with them.
+void SaveDaemonState(const BatchState* state, const char* path) {
+  char temp_path[PATH_MAX + 8];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  FILE* file = fopen(temp_path, "w");
+  if (!file) {
+    perror(temp_path);
+    return;
+  }
+  for (int i = 0; i < BATCH_CACHE_SIZE; i++) {
+    if (state->cache[i].query[0])
+      fputs(state->cache[i].result, file);
+  }
+  if (fclose(file) != 0 || rename(temp_path, path) != 0)
+    perror(path);
+}
+
+// Maximum number of config contexts that the daemon keeps loaded.
+#define DAEMON_MAX_CONTEXTS 32
+
+// Prefix of a request naming a config context, as in "@home=/home/foo<TAB>Sans
+// 10". The context is "sysroot=DIR", "file=PATH" or "home=DIR".
+#define DAEMON_CONTEXT_PREFIX '@'
+
+// Identifies a cache file so that caches shared between contexts are only
+// counted once.
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  long long size;
+} CacheFileId;
+
+// A config that the daemon serves requests from. The default context uses the
+// current config and is never evicted.
+typedef struct {
+  char name[PATH_MAX + 16];
+  BatchState state;
+  CacheFileId* cache_files;
+  int num_cache_files;
+  long long heap_size;  // Bytes allocated while loading the config.
+  unsigned long last_used;
+} DaemonContext;
+
+// LRU of loaded contexts.
+typedef struct {
+  DaemonContext contexts[DAEMON_MAX_CONTEXTS];
+  int num_contexts;
+  unsigned long clock;
+  long long memory_limit;  // Bytes, or 0 for no limit.
+} DaemonContexts;
+
+// Loads the config for context |name| with its fonts. Returns NULL on failure.
+FcConfig* LoadContextConfig(const char* name) {
+  if (strncmp(name, "file=", 5) == 0)
+    return LoadFontconfigConfig(name + 5);
+
+  if (strncmp(name, "sysroot=", 8) == 0) {
+    FcConfig* config = FcConfigCreate();
+    assert(config);
+    FcConfigSetSysRoot(config, (const FcChar8*) name + 8);
+    if (!FcConfigParseAndLoad(config, NULL, FcTrue) ||
+        !FcConfigBuildFonts(config)) {
+      FcConfigDestroy(config);
+      return NULL;
+    }
+    return config;
+  }
+
+  if (strncmp(name, "home=", 5) == 0) {
+    // Fontconfig finds per-user config and caches via these variables, so
+    // point them at the requested home while loading, and restore them before
+    // anything else can see them. Caches still go to the daemon's own cache
+    // dir so that it never writes into another user's home.
+    char cache_home[PATH_MAX] = "";
+    if (getenv("XDG_CACHE_HOME")) {
+      snprintf(cache_home, sizeof(cache_home), "%s", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME")) {
+      snprintf(cache_home, sizeof(cache_home), "%s/.cache", getenv("HOME"));
+    } else if (GetUserHome(getuid(), cache_home, sizeof(cache_home))) {
+      strncat(cache_home, "/.cache",
+              sizeof(cache_home) - strlen(cache_home) - 1);
+    }
+    const char* kVars[] = {
+      "HOME", "XDG_CONFIG_HOME", "XDG_CACHE_HOME", "XDG_DATA_HOME",
+    };
+    const int kNumVars = sizeof(kVars) / sizeof(*kVars);
+    char* saved[sizeof(kVars) / sizeof(*kVars)];
+    for (int i = 0; i < kNumVars; i++) {
+      saved[i] = getenv(kVars[i]) ? strdup(getenv(kVars[i])) : NULL;
+      unsetenv(kVars[i]);
+    }
+    setenv("HOME", name + 5, 1);
+    if (cache_home[0])
+      setenv("XDG_CACHE_HOME", cache_home, 1);
+    FcConfig* config = LoadFontconfigConfig(NULL);
+    for (int i = 0; i < kNumVars; i++) {
+      if (saved[i])
+        setenv(kVars[i], saved[i], 1);
+      else
+        unsetenv(kVars[i]);
+      free(saved[i]);
+    }
+    return config;
+  }
+  return NULL;
+}
+
+// Records the cache files backing |context|'s font dirs.
+void FindContextCacheFiles(DaemonContext* context) {
+  FcConfig* config = context->state.config ?
+      context->state.config : FcConfigGetCurrent();
+  FcStrList* dirs = FcConfigGetFontDirs(config);
+  int capacity = 0;
+  FcChar8* dir = NULL;
+  while ((dir = FcStrListNext(dirs))) {
+    FcChar8* cache_file = NULL;
+    FcCache* cache = FcDirCacheLoad(dir, config, &cache_file);
+    struct stat st;
+    if (cache && cache_file && stat((const char*) cache_file, &st) == 0) {
+      if (context->num_cache_files == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        context->cache_files = realloc(context->cache_files,
+                                       capacity * sizeof(CacheFileId));
+        assert(context->cache_files);
+      }
+      CacheFileId* id = &context->cache_files[context->num_cache_files++];
+      id->dev = st.st_dev;
+      id->ino = st.st_ino;
+      id->size = st.st_size;
+    }
+    if (cache)
+      FcDirCacheUnload(cache);
+    if (cache_file)
+      FcStrFree(cache_file);
+  }
+  FcStrListDone(dirs);
+}
+
+// Returns the number of bytes currently allocated from the heap.
+long long GetHeapInUse() {
+  const struct mallinfo2 info = mallinfo2();
+  return (long long) info.uordblks + (long long) info.hblkhd;
+}
+
+// Returns the estimated memory used by |contexts|: each context's result cache
+// and config heap, plus the mapped font caches. Fontconfig shares the mapping
+// of a cache file between configs that use the same file, so each file is
+// counted once.
+long long GetDaemonContextsMemory(const DaemonContexts* contexts) {
+  long long total = 0;
+  for (int i = 0; i < contexts->num_contexts; i++) {
+    const DaemonContext* context = &contexts->contexts[i];
+    total += BATCH_CACHE_SIZE * (long long) sizeof(BatchCacheEntry) +
+        context->heap_size;
+    for (int j = 0; j < context->num_cache_files; j++) {
+      const CacheFileId* id = &context->cache_files[j];
+      int shared = 0;
+      for (int k = 0; k < i && !shared; k++) {
+        const DaemonContext* other = &contexts->contexts[k];
+        for (int l = 0; l < other->num_cache_files && !shared; l++) {
+          shared = other->cache_files[l].dev == id->dev &&
+              other->cache_files[l].ino == id->ino;
+        }
+      }
+      if (!shared)
+        total += id->size;
+    }
+  }
+  return total;
+}
+
+void DestroyDaemonContext(DaemonContext* context) {
+  if (context->state.config)
+    FcConfigDestroy(context->state.config);
+  DestroyBatchState(&context->state);
+  free(context->cache_files);
+}
+
+// Evicts the least recently used non-default context other than |keep|.
+// Returns false if there's nothing to evict.
+int EvictDaemonContext(DaemonContexts* contexts, int keep) {
+  int victim = -1;
+  for (int i = 1; i < contexts->num_contexts; i++) {
+    if (i != keep && (victim < 0 || contexts->contexts[i].last_used <
+                      contexts->contexts[victim].last_used))
+      victim = i;
+  }
+  if (victim < 0)
+    return 0;
+  fprintf(stderr, "Evicting context \"%s\"\n", contexts->contexts[victim].name);
+  DestroyDaemonContext(&contexts->contexts[victim]);
+  contexts->contexts[victim] = contexts->contexts[--contexts->num_contexts];
+  return 1;
+}
+
+// Initializes |contexts| with the default context, which uses the current
+// config that took |heap_size| bytes to load.
+void InitDaemonContexts(DaemonContexts* contexts,
+                        long long memory_limit,
+                        long long heap_size) {
+  memset(contexts, 0, sizeof(*contexts));
+  contexts->memory_limit = memory_limit;
+  DaemonContext* context = &contexts->contexts[0];
+  context->heap_size = heap_size;
+  InitBatchState(&context->state);
+  FindContextCacheFiles(context);
+  contexts->num_contexts = 1;
+}
+
+void DestroyDaemonContexts(DaemonContexts* contexts) {
+  for (int i = 0; i < contexts->num_contexts; i++)
+    DestroyDaemonContext(&contexts->contexts[i]);
+  contexts->num_contexts = 0;
+}
+
+// Returns the index of the loaded context named |name|, or -1 if it isn't
+// loaded.
+int FindDaemonContext(const DaemonContexts* contexts, const char* name) {
+  for (int i = 0; i < contexts->num_contexts; i++) {
+    if (strcmp(contexts->contexts[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Returns the context named |name|, loading it (and evicting others to stay
+// within the memory limit) if needed. Returns NULL if it can't be loaded.
+DaemonContext* GetDaemonContext(DaemonContexts* contexts, const char* name) {
+  int index = FindDaemonContext(contexts, name);
+  if (index < 0) {
+    if (strlen(name) >= sizeof(contexts->contexts[0].name))
+      return NULL;
+    const long long heap_before = GetHeapInUse();
+    FcConfig* config = LoadContextConfig(name);
+    if (!config)
+      return NULL;
+    const long long heap_size = GetHeapInUse() - heap_before;
+    if (contexts->num_contexts == DAEMON_MAX_CONTEXTS)
+      EvictDaemonContext(contexts, -1);
+    DaemonContext* context = &contexts->contexts[contexts->num_contexts++];
+    memset(context, 0, sizeof(*context));
+    strcpy(context->name, name);
+    context->heap_size = heap_size > 0 ? heap_size : 0;
+    InitBatchState(&context->state);
+    context->state.config = config;
+    FindContextCacheFiles(context);
+
+    // Eviction moves contexts around, so look the new one up each time.
+    while (contexts->memory_limit > 0 &&
+           GetDaemonContextsMemory(contexts) > contexts->memory_limit &&
+           EvictDaemonContext(contexts, FindDaemonContext(contexts, name))) {}
+    index = FindDaemonContext(contexts, name);
+    fprintf(stderr, "Loaded context \"%s\"; %d context(s) using %.1f MiB\n",
+            name, contexts->num_contexts,
+            GetDaemonContextsMemory(contexts) / (1024.0 * 1024.0));
+  }
+  DaemonContext* context = &contexts->contexts[index];
+  context->last_used = ++contexts->clock;
+  return context;
+}
+
+// Handles a daemon request line and appends the response to |arena|. If
+// |peer_context| is non-empty, the request is answered from that context and
+// any context it names is ignored. Returns false if |arena| is too full.
+int HandleDaemonRequest(DaemonContexts* contexts,
+                        const char* line,
+                        const char* peer_context,
+                        OutputArena* arena) {
+  const char* query = line;
+  char name[PATH_MAX + 16];
+  snprintf(name, sizeof(name), "%s", peer_context);
+  if (line[0] == DAEMON_CONTEXT_PREFIX) {
+    const char* tab = strchr(line, '\t');
+    const size_t line_len = strcspn(line, "\r\n");
+    if (!tab || (size_t) (tab - line) > line_len)
+      return ArenaPrintf(arena, "%.*s\t[invalid]\n", (int) line_len, line);
+    if (!peer_context[0])
+      snprintf(name, sizeof(name), "%.*s", (int) (tab - line - 1), line + 1);
+    query = tab + 1;
+  }
+  if (!name[0])
+    return HandleBatchQuery(&contexts->contexts[0].state, query, arena);
+
+  DaemonContext* context = GetDaemonContext(contexts, name);
+  if (!context) {
+    return ArenaPrintf(arena, "%.*s\t[invalid context]\n",
+                       (int) strcspn(query, "\r\n"), query);
+  }
+  return HandleBatchQuery(&context->state, query, arena);
+}
+
+// Drops contexts whose config files or font dirs have changed, and reloads the
+// current config if it has changed. Returns true if anything was dropped or
+// reloaded.
+int RefreshDaemonContexts(DaemonContexts* contexts) {
+  int changed = 0;
+  for (int i = contexts->num_contexts - 1; i >= 1; i--) {
+    if (!FcConfigUptoDate(contexts->contexts[i].state.config)) {
+      DestroyDaemonContext(&contexts->contexts[i]);
+      contexts->contexts[i] = contexts->contexts[--contexts->num_contexts];
+      changed = 1;
+    }
+  }
+  DaemonContext* context = &contexts->contexts[0];
+  if (!FcConfigUptoDate(NULL) && FcInitReinitialize()) {
+    ClearBatchCache(&context->state);
+    free(context->cache_files);
+    context->cache_files = NULL;
+    context->num_cache_files = 0;
+    FindContextCacheFiles(context);
+    changed = 1;
+  }
+  return changed;
+}
+
+// Serves font matches over a Unix socket, either inherited via systemd-style
+// socket activation (LISTEN_FDS) or created at |socket_path|. Each request is
+// a line containing a font description, and each response is the line that
+// --batch would print. Clients running as the daemon's user may prefix
+// requests with "@CONTEXT<TAB>" to have them answered from another config
+// (see LoadContextConfig()); requests from other users are always answered
+// from the "home=" context for their home directory. Up to DAEMON_MAX_CONTEXTS
+// configs are kept in an LRU that is also bounded by |memory_limit| bytes if
+// it is positive.
+// The config generation is sent to clients when they connect and whenever the
+// config is reloaded; see font-config-client.h.
+// Responses are buffered for clients that aren't reading them, so one stalled
+// client doesn't hold up the others. Exits after |idle_timeout_sec| seconds
+// without any requests or new connections if it is positive, or on SIGTERM or
+// SIGINT. If |state_path| is non-NULL, cached
+// results are loaded from it at startup and saved to it at exit. Returns the
+// exit status.
+int RunDaemon(const char* socket_path,
+              int idle_timeout_sec,
+              const char* state_path,
+              long long memory_limit) {
+  int listen_fd = GetActivatedSocket();
+  if (listen_fd < 0 && socket_path)
+    listen_fd = CreateListeningSocket(socket_path);
+  if (listen_fd < 0) {
+    fprintf(stderr, "No socket passed via LISTEN_FDS or --daemon=PATH\n");
+    return 1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = HandleDaemonSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Load the config and fonts before accepting requests.
+  const long long heap_before = GetHeapInUse();
+  FcInit();
+  const long long heap_size = GetHeapInUse() - heap_before;
+  DaemonContexts* contexts = malloc(sizeof(DaemonContexts));
+  assert(contexts);
+  InitDaemonContexts(contexts, memory_limit, heap_size > 0 ? heap_size : 0);
+  BatchState* state = &contexts->contexts[0].state;
+  const int num_loaded = state_path ? LoadDaemonState(state, state_path) : 0;
+  fprintf(stderr, "Daemon ready with %d saved result(s)\n", num_loaded);
+
+  DaemonClient* clients = calloc(DAEMON_MAX_CLIENTS, sizeof(DaemonClient));
+  assert(clients);
+  int num_clients = 0;
+  OutputArena arena = { malloc(BATCH_OUTPUT_SIZE), BATCH_OUTPUT_SIZE, 0 };
+  assert(arena.data);
+  struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+
+  // Generations start at the startup time so that they differ across restarts.
+  long generation = time(NULL);
+  time_t last_activity = time(NULL);
+  time_t last_config_check = time(NULL);
+
+  while (!daemon_stopping) {
+    fds[0].fd = listen_fd;
+    fds[0].events = num_clients < DAEMON_MAX_CLIENTS ? POLLIN : 0;
+    for (int i = 0; i < num_clients; i++) {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events =
+          (clients[i].out_len < DAEMON_MAX_PENDING_OUTPUT ? POLLIN : 0) |
+          (clients[i].out_len > 0 ? POLLOUT : 0);
+    }
+    int timeout_ms = DAEMON_CONFIG_CHECK_INTERVAL_SEC * 1000;
+    if (idle_timeout_sec > 0) {
+      const long idle_ms = (last_activity + idle_timeout_sec - time(NULL)) *
+          1000L;
+      if (idle_ms < timeout_ms)
+        timeout_ms = idle_ms > 0 ? idle_ms : 0;
+    }
+    const int num_ready = poll(fds, num_clients + 1, timeout_ms);
+    if (num_ready < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    const time_t now = time(NULL);
+    if (idle_timeout_sec > 0 && now - last_activity >= idle_timeout_sec) {
+      fprintf(stderr, "Exiting after %d second(s) idle\n", idle_timeout_sec);
+      break;
+    }
+
+    // Reload the config if its files or font dirs changed, and tell clients
+    // that their cached results are stale.
+    if (now - last_config_check >= DAEMON_CONFIG_CHECK_INTERVAL_SEC) {
+      last_config_check = now;
+      if (RefreshDaemonContexts(contexts)) {
+        generation++;
+        fprintf(stderr, "Config changed; now at generation %ld\n",
+                generation);
+        for (int i = 0; i < num_clients; i++)
+          SendDaemonGeneration(&clients[i], generation);
+      }
+    }
+
+    // Walk backwards so that disconnected clients can be swapped out.
+    for (int i = num_clients - 1; i >= 0; i--) {
+      DaemonClient* client = &clients[i];
+      int connected = 1;
+      if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+        const ssize_t len = read(client->fd, client->buf + client->len,
+                                 sizeof(client->buf) - client->len - 1);
+        connected = len > 0 || (len < 0 && (errno == EAGAIN || errno == EINTR));
+        if (len > 0) {
+          client->len += len;
+          client->buf[client->len] = '\0';
+          char* line = client->buf;
+          char* newline = NULL;
+          if (client->discarding) {
+            newline = strchr(line, '\n');
+            line = newline ? newline + 1 : client->buf + client->len;
+            client->discarding = !newline;
+          }
+          while ((newline = strchr(line, '\n'))) {
+            if (!HandleDaemonRequest(contexts, line, client->peer_context,
+                                     &arena)) {
+              QueueDaemonOutput(client, arena.data, arena.used);
+              arena.used = 0;
+              HandleDaemonRequest(contexts, line, client->peer_context,
+                                  &arena);
+            }
+            line = newline + 1;
+            last_activity = now;
+          }
+          QueueDaemonOutput(client, arena.data, arena.used);
+          arena.used = 0;
+          client->len -= line - client->buf;
+          memmove(client->buf, line, client->len);
+          // Answer an over-long request once, and skip the rest of it so that
+          // responses stay in step with requests.
+          if (client->len == sizeof(client->buf) - 1) {
+            QueueDaemonOutput(client, kDaemonInvalidResponse,
+                              strlen(kDaemonInvalidResponse));
+            client->len = 0;
+            client->discarding = 1;
+          }
+        }
+      }
+      if (connected && client->out_len > 0)
+        connected = FlushDaemonOutput(client);
+      if (!connected) {
+        close(client->fd);
+        free(client->out);
+        *client = clients[--num_clients];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      const int fd = accept4(listen_fd, NULL, NULL,
+                             SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (fd >= 0) {
+        DaemonClient* client = &clients[num_clients++];
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+        InitDaemonPeerContext(client);
+        SendDaemonGeneration(client, generation);
+        FlushDaemonOutput(client);
+        last_activity = now;
+      }
+    }
+  }
+
+  for (int i = 0; i < num_clients; i++) {
+    close(clients[i].fd);
+    free(clients[i].out);
+  }
+  if (state_path)
+    SaveDaemonState(state, state_path);
+  if (socket_path && listen_fd != LISTEN_FDS_START)
+    unlink(socket_path);
+  close(listen_fd);
+  int num_queries = 0, num_cache_hits = 0;
+  for (int i = 0; i < contexts->num_contexts; i++) {
+    num_queries += contexts->contexts[i].state.num_queries;
+    num_cache_hits += contexts->contexts[i].state.num_cache_hits;
+  }
+  fprintf(stderr, "%d queries, %d cache hits\n", num_queries, num_cache_hits);
+
+  free(arena.data);
+  free(clients);
+  DestroyDaemonContexts(contexts);
+  free(contexts);
+  return 0;
+}
+
+// Environment variables recorded by --capture and restored by --replay.
+const char* kCapturedEnvironmentVariables[] = {
+  "FONTCONFIG_FILE",
+  "FONTCONFIG_PATH",
+  "FONTCONFIG_SYSROOT",
+  "HOME",
+  "XDG_CONFIG_HOME",
+  "XDG_DATA_HOME",
+  "XDG_CACHE_HOME",
+  "LANG",
+  "LANGUAGE",
+  "LC_ALL",
+  "LC_CTYPE",
+  "GDK_SCALE",
+  "GDK_DPI_SCALE",
+  "QT_SCALE_FACTOR",
+  "QT_FONT_DPI",
+};
+
+// GSettings keys from kGnomeInterfaceSchema recorded by --capture.
+const char* kCapturedGSettingsKeys[] = {
+  "font-name",
+  "monospace-font-name",
+  "document-font-name",
+  "text-scaling-factor",
+  "font-antialiasing",
+  "font-hinting",
+  "font-rgba-order",
+};
+
+// Creates all of the directories leading up to the final component of |path|.
+// Returns false on failure.
+int MakeParentDirs(const char* path) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char* slash = strchr(dir + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+      perror(dir);
+      return 0;
+    }
+    *slash = '/';
+  }
+  return 1;
+}
+
+// Copies |src| to |dest|, creating |dest|'s parent directories. Returns false
+// on failure.
+int CopyFile(const char* src, const char* dest) {
+  if (!MakeParentDirs(dest))
+    return 0;
+  FILE* in = fopen(src, "rb");
+  if (!in) {
+    perror(src);
+    return 0;
+  }
+  FILE* out = fopen(dest, "wb");
+  if (!out) {
+    perror(dest);
+    fclose(in);
+    return 0;
+  }
+  char buf[8192];
+  size_t len = 0;
+  while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, len, out);
+  fclose(in);
+  return fclose(out) == 0;
+}
+
+// Writes the hex SHA-256 digest of the file at |path| to |hash|, which must
+// hold at least 65 bytes. Returns false on failure.
+int HashFile(const char* path, char* hash) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return 0;
+  GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  guchar buf[8192];
+  size_t len = 0;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+    g_checksum_update(checksum, buf, len);
+  fclose(file);
+  snprintf(hash, 65, "%s", g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return 1;
+}
+
+// Returns the size of the file at |path|, or -1 if it can't be read.
+long long GetFileSize(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long long) st.st_size : -1;
+}
+
+// Writes the output of |command| to the file at |path|. Returns false if the
+// command failed.
+int WriteCommandOutput(const char* command, const char* path) {
+  fflush(NULL);
+  FILE* pipe = popen(command, "r");
+  if (!pipe)
+    return 0;
+  FILE* out = fopen(path, "w");
+  char buf[4096];
+  size_t len = 0;
+  while ((len = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+    if (out)
+      fwrite(buf, 1, len, out);
+  }
+  if (out)
+    fclose(out);
+  const int status = pclose(pipe);
+  return out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Writes the font environment to the bundle directory |bundle| for later use
+// by --replay: a manifest listing environment variables, screen geometry,
+// GSettings values, config files and fonts (with SHA-256 hashes), plus copies
+// of the config files at their original paths under |bundle|/root, copies of
+// the fonts named by hash in |bundle|/fonts, and the raw X resources and
+// XSETTINGS. GTK must be initialized. Returns false on failure.
+int CaptureEnvironment(const char* bundle) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/manifest", bundle);
+  if (!MakeParentDirs(path))
+    return 0;
+  FILE* manifest = fopen(path, "w");
+  if (!manifest) {
+    perror(path);
+    return 0;
+  }
+
+  for (size_t i = 0; i < sizeof(kCapturedEnvironmentVariables) /
+                         sizeof(*kCapturedEnvironmentVariables); i++) {
+    const char* value = getenv(kCapturedEnvironmentVariables[i]);
+    if (value)
+      fprintf(manifest, "env %s=%s\n", kCapturedEnvironmentVariables[i], value);
+  }
+
+  Display* display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+  assert(display);
+  const int screen = DefaultScreen(display);
+  fprintf(manifest, "screen %d %d %d %d\n",
+          DisplayWidth(display, screen), DisplayHeight(display, screen),
+          DisplayWidthMM(display, screen), DisplayHeightMM(display, screen));
+
+  const char* resources = XResourceManagerString(display);
+  snprintf(path, sizeof(path), "%s/xresources", bundle);
+  FILE* file = fopen(path, "w");
+  if (file) {
+    fputs(resources ? resources : "", file);
+    fclose(file);
+  }
+
+  // dump_xsettings' output is in xsettingsd's config format.
+  snprintf(path, sizeof(path), "%s/xsettings", bundle);
+  if (!WriteCommandOutput("dump_xsettings 2>/dev/null", path))
+    unlink(path);
+
+  if (HasGSettingsSchema(kGnomeInterfaceSchema)) {
+    GSettingsSchema* schema = g_settings_schema_source_lookup(
+        g_settings_schema_source_get_default(), kGnomeInterfaceSchema, TRUE);
+    GSettings* settings = g_settings_new(kGnomeInterfaceSchema);
+    for (size_t i = 0; i < sizeof(kCapturedGSettingsKeys) /
+                           sizeof(*kCapturedGSettingsKeys); i++) {
+      if (!schema || !g_settings_schema_has_key(schema,
+                                                kCapturedGSettingsKeys[i]))
+        continue;
+      GVariant* variant =
+          g_settings_get_value(settings, kCapturedGSettingsKeys[i]);
+      gchar* value = g_variant_print(variant, FALSE);
+      fprintf(manifest, "gsettings %s %s\n", kCapturedGSettingsKeys[i], value);
+      g_free(value);
+      g_variant_unref(variant);
+    }
+    g_object_unref(settings);
+    if (schema)
+      g_settings_schema_unref(schema);
+  }
+
+  // Copy config files (including those pulled in by <include>) to their
+  // original locations under the bundle's root. Included directories like
+  // conf.d are listed too, and are recreated as directories.
+  FcStrList* config_files = FcConfigGetConfigFiles(NULL);
+  FcChar8* config_file = NULL;
+  int num_config_files = 0;
+  while ((config_file = FcStrListNext(config_files))) {
+    struct stat st;
+    if (stat((const char*) config_file, &st) != 0) {
+      perror((const char*) config_file);
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      snprintf(path, sizeof(path), "%s/root%s/", bundle, config_file);
+      if (MakeParentDirs(path))
+        fprintf(manifest, "configdir %s\n", config_file);
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/root%s", bundle, config_file);
+    if (CopyFile((const char*) config_file, path)) {
+      fprintf(manifest, "config %s\n", config_file);
+      num_config_files++;
+    }
+  }
+  FcStrListDone(config_files);
+
+  // Fonts are copied to the bundle's fonts directory under their hashes, so
+  // that replay doesn't depend on the bench machine having them installed.
+  FcPattern* pattern = FcPatternCreate();
+  FcObjectSet* objects = FcObjectSetBuild(FC_FILE, NULL);
+  FcFontSet* fonts = FcFontList(NULL, pattern, objects);
+  int num_fonts = 0, num_copied_fonts = 0;
+  for (int i = 0; fonts && i < fonts->nfont; i++) {
+    FcChar8* font_file = NULL;
+    char hash[65];
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &font_file) !=
+        FcResultMatch || !HashFile((const char*) font_file, hash))
+      continue;
+    fprintf(manifest, "font %s %lld %s\n", hash,
+            GetFileSize((const char*) font_file), font_file);
+    num_fonts++;
+    snprintf(path, sizeof(path), "%s/fonts/%s", bundle, hash);
+    if (access(path, F_OK) == 0 || CopyFile((const char*) font_file, path))
+      num_copied_fonts++;
+  }
+  if (fonts)
+    FcFontSetDestroy(fonts);
+  FcObjectSetDestroy(objects);
+  FcPatternDestroy(pattern);
+  fclose(manifest);
+
+  printf("Captured %d config file(s) and %d font file(s) (%d copied) to %s\n",
+         num_config_files, num_fonts, num_copied_fonts, bundle);
+  return 1;
+}
+
+// Looks for a file with SHA-256 digest |hash| and size |size| among the fonts
+// known to the local config and the files in |fixture_dir|. Copies the path to
+// |found| and returns true if one is present.
+int FindFontByHash(const char* hash,
+                   long long size,
+                   FcFontSet* local_fonts,
+                   const char* fixture_dir,
+                   char* found,
+                   size_t found_size) {
+  char candidate_hash[65];
+  for (int i = 0; local_fonts && i < local_fonts->nfont; i++) {
+    FcChar8* file = NULL;
+    if (FcPatternGetString(local_fonts->fonts[i], FC_FILE, 0, &file) !=
+        FcResultMatch || GetFileSize((const char*) file) != size)
+      continue;
+    if (HashFile((const char*) file, candidate_hash) &&
+        strcmp(hash, candidate_hash) == 0) {
+      snprintf(found, found_size, "%s", file);
+      return 1;
+    }
+  }
+
+  DIR* dir = opendir(fixture_dir);
+  if (!dir)
+    return 0;
+  struct dirent* entry = NULL;
+  int ret = 0;
+  while (!ret && (entry = readdir(dir))) {
+    snprintf(found, found_size, "%s/%s", fixture_dir, entry->d_name);
+    ret = GetFileSize(found) == size && HashFile(found, candidate_hash) &&
+        strcmp(hash, candidate_hash) == 0;
+  }
+  closedir(dir);
+  return ret;
+}
+
+// Starts Xvfb with a screen matching the captured geometry and returns its pid,
+// storing its display name in |display_name|. Returns -1 on failure.
+pid_t StartXvfb(int width_px,
+                int height_px,
+                int width_mm,
+                char* display_name,
+                size_t display_name_size) {
+  int fds[2];
+  if (pipe(fds) != 0)
+    return -1;
+
+  char screen[64], dpi[32], displayfd[32];
+  snprintf(screen, sizeof(screen), "%dx%dx24", width_px, height_px);
+  snprintf(dpi, sizeof(dpi), "%d",
+           width_mm > 0 ? (int) (width_px * 25.4 / width_mm + 0.5) : 96);
+  snprintf(displayfd, sizeof(displayfd), "%d", fds[1]);
+
+  fflush(NULL);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    execlp("Xvfb", "Xvfb", "-screen", "0", screen, "-dpi", dpi,
+           "-displayfd", displayfd, "-nolisten", "tcp", (char*) NULL);
+    perror("Xvfb");
+    _exit(1);
+  }
+  close(fds[1]);
+
+  // Xvfb writes the display number to the pipe once it's ready.
+  char buf[32] = "";
+  const ssize_t len = pid > 0 ? read(fds[0], buf, sizeof(buf) - 1) : -1;
+  close(fds[0]);
+  if (len <= 0) {
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+    }
+    return -1;
+  }
+  buf[len] = '\0';
+  snprintf(display_name, display_name_size, ":%d", atoi(buf));
+  return pid;
+}
+
+// Stops the process |pid| started by ReplayEnvironment().
+void StopProcess(pid_t pid) {
+  if (pid <= 0)
+    return;
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+// Reconstructs the environment captured in |bundle| and reruns this program
+// with |argv| (which should request a benchmark) inside of it.
+// Captured fonts are located by hash among local fonts and files in
+// |bundle|/fonts and symlinked to their original paths under |bundle|/root,
+// which is used as FONTCONFIG_SYSROOT along with the captured config files.
+// X resources and XSETTINGS are loaded into an Xvfb server with the captured
+// screen geometry. Returns the program's exit status.
+int ReplayEnvironment(const char* bundle, char** argv) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/manifest", bundle);
+  FILE* manifest = fopen(path, "r");
+  if (!manifest) {
+    perror(path);
+    return 1;
+  }
+
+  char root[PATH_MAX];
+  snprintf(root, sizeof(root), "%s/root", bundle);
+  char fixture_dir[PATH_MAX];
+  snprintf(fixture_dir, sizeof(fixture_dir), "%s/fonts", bundle);
+
+  FcPattern* pattern = FcPatternCreate();
+  FcObjectSet* objects = FcObjectSetBuild(FC_FILE, NULL);
+  FcFontSet* local_fonts = FcFontList(NULL, pattern, objects);
+
+  int width_px = 0, height_px = 0, width_mm = 0, height_mm = 0;
+  int num_fonts = 0, num_missing_fonts = 0, num_gsettings = 0;
+  char line[PATH_MAX + 128];
+  while (fgets(line, sizeof(line), manifest)) {
+    line[strcspn(line, "\n")] = '\0';
+    char hash[65];
+    long long size = 0;
+    int offset = 0;
+    if (strncmp(line, "env ", 4) == 0) {
+      char* value = strchr(line + 4, '=');
+      if (value) {
+        *value = '\0';
+        setenv(line + 4, value + 1, 1);
+      }
+    } else if (sscanf(line, "screen %d %d %d %d", &width_px, &height_px,
+                      &width_mm, &height_mm) == 4) {
+      continue;
+    } else if (strncmp(line, "gsettings ", 10) == 0) {
+      num_gsettings++;
+    } else if (sscanf(line, "font %64s %lld %n", hash, &size, &offset) == 2 &&
+               offset > 0) {
+      const char* font_path = line + offset;
+      char found[PATH_MAX];
+      snprintf(path, sizeof(path), "%s%s", root, font_path);
+      num_fonts++;
+      if (access(path, F_OK) == 0)
+        continue;
+      if (!FindFontByHash(hash, size, local_fonts, fixture_dir, found,
+                          sizeof(found))) {
+        fprintf(stderr, "No local font matches %s (%s)\n", font_path, hash);
+        num_missing_fonts++;
+        continue;
+      }
+      if (!MakeParentDirs(path) || symlink(found, path) != 0) {
+        perror(path);
+        num_missing_fonts++;
+      }
+    }
+  }
+  fclose(manifest);
+  if (local_fonts)
+    FcFontSetDestroy(local_fonts);
+  FcObjectSetDestroy(objects);
+  FcPatternDestroy(pattern);
+
+  printf("Replaying %s: %d of %d font(s) found\n", bundle,
+         num_fonts - num_missing_fonts, num_fonts);
+  if (num_gsettings > 0)
+    printf("Note: %d GSettings value(s) are recorded but not replayed\n",
+           num_gsettings);
+  setenv("FONTCONFIG_SYSROOT", root, 1);
+
+  pid_t xvfb_pid = -1, xsettingsd_pid = -1;
+  if (width_px > 0 && height_px > 0) {
+    char display_name[32];
+    xvfb_pid = StartXvfb(width_px, height_px, width_mm, display_name,
+                         sizeof(display_name));
+    if (xvfb_pid < 0) {
+      fprintf(stderr, "Failed to start Xvfb\n");
+      return 1;
+    }
+    setenv("DISPLAY", display_name, 1);
+
+    // The recorded resources are the server's already preprocessed string, so
+    // don't let xrdb run them through cpp, which would act on #include lines.
+    snprintf(path, sizeof(path), "%s/xresources", bundle);
+    if (access(path, R_OK) == 0) {
+      fflush(NULL);
+      const pid_t xrdb_pid = fork();
+      if (xrdb_pid == 0) {
+        execlp("xrdb", "xrdb", "-nocpp", "-load", path, (char*) NULL);
+        perror("xrdb");
+        _exit(1);
+      }
+      int xrdb_status = 0;
+      if (xrdb_pid < 0 || waitpid(xrdb_pid, &xrdb_status, 0) < 0 ||
+          !WIFEXITED(xrdb_status) || WEXITSTATUS(xrdb_status) != 0)
+        fprintf(stderr, "Failed to load X resources with xrdb\n");
+    }
+
+    snprintf(path, sizeof(path), "%s/xsettings", bundle);
+    if (access(path, R_OK) == 0) {
+      fflush(NULL);
+      xsettingsd_pid = fork();
+      if (xsettingsd_pid == 0) {
+        execlp("xsettingsd", "xsettingsd", "-c", path, (char*) NULL);
+        perror("xsettingsd");
+        _exit(1);
+      }
+    }
+  }
+
+  fflush(NULL);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    _exit(1);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0)
+    status = 1;
+
+  StopProcess(xsettingsd_pid);
+  StopProcess(xvfb_pid);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// Reads big-endian integers from font data.
+uint16_t ReadU16(const unsigned char* p) {
+  return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+uint32_t ReadU32(const unsigned char* p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+      (uint32_t) p[2] << 8 | p[3];
+}
+
+void WriteU16(unsigned char* p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+void WriteU32(unsigned char* p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = (value >> 16) & 0xff;
+  p[2] = (value >> 8) & 0xff;
+  p[3] = value & 0xff;
+}
+
+// Returns the sfnt checksum of |size| bytes at |data|.
+uint32_t GetSfntChecksum(const unsigned char* data, size_t size) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < size; i += 4) {
+    unsigned char word[4] = { 0, 0, 0, 0 };
+    memcpy(word, data + i, size - i < 4 ? size - i : 4);
+    sum += ReadU32(word);
+  }
+  return sum;
+}
+
+// Font file contents loaded by ReadFontFile().
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  const char* path;
+} FontFile;
+
+// Reads the TrueType or OpenType font at |path| into |font|. Returns false if
+// it can't be read or isn't a single-face sfnt.
+int ReadFontFile(const char* path, FontFile* font) {
+  const long long size = GetFileSize(path);
+  FILE* file = fopen(path, "rb");
+  if (size < 12 || !file) {
+    if (file)
+      fclose(file);
+    return 0;
+  }
+  font->data = malloc(size);
+  assert(font->data);
+  font->size = fread(font->data, 1, size, file);
+  font->path = path;
+  fclose(file);
+
+  const uint32_t version = ReadU32(font->data);
+  if (font->size != (size_t) size ||
+      (version != 0x00010000 && version != 0x4f54544f /* 'OTTO' */) ||
+      12 + 16 * (size_t) ReadU16(font->data + 4) > font->size) {
+    free(font->data);
+    return 0;
+  }
+  return 1;
+}
+
+// Returns |font|'s table directory entry for |tag|, or NULL if it's missing or
+// out of bounds.
+unsigned char* FindSfntTable(const FontFile* font, const char* tag) {
+  const int num_tables = ReadU16(font->data + 4);
+  for (int i = 0; i < num_tables; i++) {
+    unsigned char* entry = font->data + 12 + 16 * i;
+    if (memcmp(entry, tag, 4) == 0) {
+      const size_t offset = ReadU32(entry + 8), length = ReadU32(entry + 12);
+      return offset + length <= font->size ? entry : NULL;
+    }
+  }
+  return NULL;
+}
+
+// Writes a copy of |font| to |path| with its family-related 'name' records
+// (family, unique ID, full name, PostScript name, and typographic and WWS
+// family) replaced by |family|. The new 'name' table is appended to the file
+// and the table directory and head checksum adjustment are updated. Returns
+// false on failure.
+int WriteRenamedFont(const FontFile* font, const char* family,
+                     const char* path) {
+  const unsigned char* name_entry = FindSfntTable(font, "name");
+  unsigned char* head_entry = FindSfntTable(font, "head");
+  if (!name_entry || !head_entry || ReadU32(head_entry + 12) < 12)
+    return 0;
+  const unsigned char* name = font->data + ReadU32(name_entry + 8);
+  const size_t name_length = ReadU32(name_entry + 12);
+  const int count = name_length >= 6 ? ReadU16(name + 2) : 0;
+  const size_t string_offset = name_length >= 6 ? ReadU16(name + 4) : 0;
+  if (6 + 12 * (size_t) count > name_length || string_offset > name_length)
+    return 0;
+
+  // The new table is written in format 0, so records using format 1 language
+  // tags are dropped. Replacement strings are at most 2 * 128 bytes.
+  const size_t max_size = 6 + 12 * count + name_length + count * 256;
+  const size_t aligned_size = (font->size + 3) & ~(size_t) 3;
+  unsigned char* data = calloc(aligned_size + max_size + 3, 1);
+  assert(data);
+  memcpy(data, font->data, font->size);
+  unsigned char* table = data + aligned_size;
+  unsigned char* records = table + 6;
+  int num_records = 0;
+  for (int i = 0; i < count; i++) {
+    const unsigned char* record = name + 6 + 12 * i;
+    if (ReadU16(record + 4) >= 0x8000)
+      continue;
+    memcpy(records + 12 * num_records++, record, 12);
+  }
+  unsigned char* strings = records + 12 * num_records;
+  size_t strings_size = 0;
+  for (int i = 0; i < num_records; i++) {
+    unsigned char* record = records + 12 * i;
+    const int platform = ReadU16(record), name_id = ReadU16(record + 6);
+    size_t length = ReadU16(record + 8);
+    const size_t offset = string_offset + ReadU16(record + 10);
+    unsigned char* dest = strings + strings_size;
+    if (name_id == 1 || name_id == 3 || name_id == 4 || name_id == 6 ||
+        name_id == 16 || name_id == 21) {
+      // PostScript names can't contain spaces. Unicode and Windows names are
+      // UTF-16BE, while the others are treated as single-byte ASCII.
+      length = 0;
+      for (const char* ch = family; *ch && ch - family < 128; ch++) {
+        if (name_id == 6 && *ch == ' ')
+          continue;
+        if (platform == 0 || platform == 3)
+          dest[length++] = 0;
+        dest[length++] = *ch;
+      }
+    } else {
+      if (offset + length > name_length)
+        length = 0;
+      memcpy(dest, name + offset, length);
+    }
+    WriteU16(record + 8, length);
+    WriteU16(record + 10, strings_size);
+    strings_size += length;
+  }
+  WriteU16(table, 0);
+  WriteU16(table + 2, num_records);
+  WriteU16(table + 4, 6 + 12 * num_records);
+  const size_t table_size = 6 + 12 * num_records + strings_size;
+
+  // Point the directory at the new table and recompute checksums.
+  unsigned char* new_name_entry = data + (name_entry - font->data);
+  WriteU32(new_name_entry + 4, GetSfntChecksum(table, table_size));
+  WriteU32(new_name_entry + 8, aligned_size);
+  WriteU32(new_name_entry + 12, table_size);
+  unsigned char* head = data + ReadU32(head_entry + 8);
+  WriteU32(head + 8, 0);
+  const size_t size = aligned_size + ((table_size + 3) & ~(size_t) 3);
+  WriteU32(head + 8, 0xb1b0afba - GetSfntChecksum(data, size));
+
+  FILE* file = fopen(path, "wb");
+  const int ret = file && fwrite(data, 1, size, file) == size;
+  if (file && fclose(file) != 0) {
+    perror(path);
+    free(data);
+    return 0;
+  }
+  free(data);
+  return ret;
+}
+
+// Returns the total size of the regular files in |path|.
+long long GetDirSize(const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir)
+    return 0;
+  long long total = 0;
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dir))) {
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    struct stat st;
+    if (stat(file, &st) == 0 && S_ISREG(st.st_mode))
+      total += st.st_size;
+  }
+  closedir(dir);
+  return total;
+}
+
+// State shared by the scaling benchmarks' iterations.
+typedef struct {
+  const char* config_path;
+  FcConfig* config;
+  FcPattern* query;  // Substituted query for |config|.
+} ScalingBenchmarkData;
+
+void RunScalingInitIteration(void* data) {
+  FcConfig* config =
+      LoadFontconfigConfig(((ScalingBenchmarkData*) data)->config_path);
+  if (config)
+    FcConfigDestroy(config);
+}
+
+void RunScalingMatchIteration(void* data) {
+  const ScalingBenchmarkData* scaling = (const ScalingBenchmarkData*) data;
+  FcResult result;
+  FcPattern* match = FcFontMatch(scaling->config, scaling->query, &result);
+  if (match)
+    FcPatternDestroy(match);
+}
+
+void RunScalingSortIteration(void* data) {
+  const ScalingBenchmarkData* scaling = (const ScalingBenchmarkData*) data;
+  FcResult result;
+  FcFontSet* fonts =
+      FcFontSort(scaling->config, scaling->query, FcTrue, NULL, &result);
+  if (fonts)
+    FcFontSetDestroy(fonts);
+}
+
+void RunScalingListIteration(void* data) {
+  const ScalingBenchmarkData* scaling = (const ScalingBenchmarkData*) data;
+  FcPattern* pattern = FcPatternCreate();
+  FcObjectSet* objects = FcObjectSetBuild(FC_FAMILY, FC_STYLE, FC_FILE, NULL);
+  FcFontSet* fonts = FcFontList(scaling->config, pattern, objects);
+  if (fonts)
+    FcFontSetDestroy(fonts);
+  FcObjectSetDestroy(objects);
+  FcPatternDestroy(pattern);
+}
+
+// Runs |func| via RunBenchmark() as the metric |prefix|-|name|-|n| and
+// returns its median time in nanoseconds.
+double RunScalingBenchmark(const BenchmarkOptions* options,
+                           const char* prefix,
+                           const char* name,
+                           int n,
+                           BenchmarkFunc func,
+                           void* data) {
+  char metric[64];
+  snprintf(metric, sizeof(metric), "%s-%s-%d", prefix, name, n);
+  BenchmarkResult result;
+  free(RunBenchmark(options, metric, func, data, &result));
+  return result.median;
+}
+
+// Returns the number of faces that the inventory scaling sweep generates at
+// each step, up to |max_faces|. Steps are at 10, 100, 1000, etc.
+int GetNextScalingStep(int step, int max_faces) {
+  const int next = step * 10;
+  return step < max_faces && next > max_faces ? max_faces : next;
+}
+
+// Generates synthetic font inventories of increasing size (10, 100, ..., up to
+// |max_faces|) in |dir| by cloning the |num_fixtures| fonts in |fixtures| into
+// distinct "Synthetic NNNNNN" families, with each family containing one face
+// per fixture. At each step, measures building the cache, loading the config
+// with its caches, FcFontMatch(), FcFontSort() and FcFontList() against the
+// inventory, along with the cache size.
+void RunInventoryScaling(const BenchmarkOptions* options,
+                         const char* dir,
+                         const char** fixtures,
+                         int num_fixtures,
+                         int max_faces) {
+  FontFile* fonts = calloc(num_fixtures, sizeof(FontFile));
+  assert(fonts);
+  long long fixture_size = 0;
+  for (int i = 0; i < num_fixtures; i++) {
+    if (!ReadFontFile(fixtures[i], &fonts[i])) {
+      fprintf(stderr, "%s isn't a single-face TrueType or OpenType font\n",
+              fixtures[i]);
+      for (int j = 0; j < i; j++)
+        free(fonts[j].data);
+      free(fonts);
+      return;
+    }
+    fixture_size += fonts[i].size;
+  }
+
+  char font_dir[PATH_MAX], cache_dir[PATH_MAX], config_path[PATH_MAX];
+  snprintf(font_dir, sizeof(font_dir), "%s/fonts", dir);
+  snprintf(cache_dir, sizeof(cache_dir), "%s/cache", dir);
+  snprintf(config_path, sizeof(config_path), "%s/fonts.conf", dir);
+  FILE* config_file = NULL;
+  if (!MakeParentDirs(config_path) || mkdir(font_dir, 0755) != 0 ||
+      !(config_file = fopen(config_path, "w"))) {
+    fprintf(stderr, "Failed to set up %s; it must not already exist\n", dir);
+    num_fixtures = 0;
+  } else {
+    fprintf(config_file,
+            "<?xml version=\"1.0\"?>\n"
+            "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+            "<fontconfig>\n"
+            "  <dir>%s</dir>\n"
+            "  <cachedir>%s</cachedir>\n"
+            "</fontconfig>\n", font_dir, cache_dir);
+    fclose(config_file);
+  }
+
+  printf("Inventory scaling (%s, %d fixture(s)):\n", dir, num_fixtures);
+  printf("%-8s %-12s %-12s %-12s %-12s %-12s %s\n", "faces", "cache build",
+         "init", "match", "sort", "list", "cache size");
+  int num_faces = 0;
+  for (int step = 10; num_fixtures > 0 && step <= max_faces;
+       step = GetNextScalingStep(step, max_faces)) {
+    struct statvfs fs;
+    if (statvfs(dir, &fs) == 0 &&
+        (long long) fs.f_bavail * fs.f_frsize <
+        (step - num_faces) * fixture_size / num_fixtures) {
+      printf("[stopping: not enough disk space for %d faces]\n", step);
+      break;
+    }
+    for (; num_faces < step; num_faces++) {
+      char family[64], path[PATH_MAX + 32];
+      snprintf(family, sizeof(family), "Synthetic %06d",
+               num_faces / num_fixtures);
+      snprintf(path, sizeof(path), "%s/synthetic-%06d.%s", font_dir,
+               num_faces,
+               ReadU32(fonts[num_faces % num_fixtures].data) == 0x4f54544f ?
+               "otf" : "ttf");
+      if (!WriteRenamedFont(&fonts[num_faces % num_fixtures], family, path)) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        break;
+      }
+    }
+
+    const double build_start = GetTimeNs();
+    ScalingBenchmarkData data = { config_path, NULL, NULL };
+    data.config = LoadFontconfigConfig(config_path);
+    const double build_time = GetTimeNs() - build_start;
+    if (!data.config) {
+      printf("[failed to load %s]\n", config_path);
+      break;
+    }
+
+    // Query a family in the middle of the inventory.
+    char family[64];
+    snprintf(family, sizeof(family), "Synthetic %06d",
+             num_faces / num_fixtures / 2);
+    data.query = FcPatternCreate();
+    FcPatternAddString(data.query, FC_FAMILY, (const FcChar8*) family);
+    FcPatternAddDouble(data.query, FC_SIZE, 12.0);
+    FcConfigSubstitute(data.config, data.query, FcMatchPattern);
+    FcDefaultSubstitute(data.query);
+
+    double times[5] = { build_time };
+    times[1] = RunScalingBenchmark(options, "inventory", "init", num_faces,
+                                   RunScalingInitIteration, &data);
+    times[2] = RunScalingBenchmark(options, "inventory", "match", num_faces,
+                                   RunScalingMatchIteration, &data);
+    times[3] = RunScalingBenchmark(options, "inventory", "sort", num_faces,
+                                   RunScalingSortIteration, &data);
+    times[4] = RunScalingBenchmark(options, "inventory", "list", num_faces,
+                                   RunScalingListIteration, &data);
+    printf("%-8d", num_faces);
+    for (int i = 0; i < 5; i++) {
+      char str[32];
+      FormatDuration(times[i], str, sizeof(str));
+      printf(" %-12s", str);
+    }
+    printf(" %.1f KiB\n", GetDirSize(cache_dir) / 1024.0);
+    fflush(stdout);
+
+    FcPatternDestroy(data.query);
+    FcConfigDestroy(data.config);
+  }
+  printf("\n");
+
+  for (int i = 0; i < num_fixtures; i++)
+    free(fonts[i].data);
+  free(fonts);
+}
+
+void RunScalingSubstituteIteration(void* data) {
+  const ScalingBenchmarkData* scaling = (const ScalingBenchmarkData*) data;
+  FcPattern* query = FcPatternDuplicate(scaling->query);
+  FcConfigSubstitute(scaling->config, query, FcMatchPattern);
+  FcDefaultSubstitute(query);
+  FcPatternDestroy(query);
+}
+
+void RunScalingFullMatchIteration(void* data) {
+  const ScalingBenchmarkData* scaling = (const ScalingBenchmarkData*) data;
+  FcPattern* query = FcPatternDuplicate(scaling->query);
+  FcConfigSubstitute(scaling->config, query, FcMatchPattern);
+  FcDefaultSubstitute(query);
+  FcResult result;
+  FcPattern* match = FcFontMatch(scaling->config, query, &result);
+  if (match)
+    FcPatternDestroy(match);
+  FcPatternDestroy(query);
+}
+
+// Languages tested by generated lang rules. English is omitted so that the
+// rules are evaluated but don't fire for typical queries, as with most distro
+// language snippets.
+const char* kSyntheticRuleLangs[] = {
+  "ja", "ko", "zh-cn", "zh-tw", "ar", "he", "hi", "th", "ru", "el",
+};
+
+// Writes the |index|th synthetic config snippet to |file|. Snippets cycle
+// between a family alias, a size-conditioned hinting rule, and a lang rule.
+// The hinting rule only tests the pixel size, since matched fonts never have
+// a synthetic family, so that its test is evaluated for every match.
+void WriteSyntheticConfigRule(FILE* file, int index) {
+  fprintf(file,
+          "<?xml version=\"1.0\"?>\n"
+          "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+          "<fontconfig>\n");
+  switch (index % 3) {
+    case 0:
+      fprintf(file,
+              "  <alias>\n"
+              "    <family>Synthetic Alias %d</family>\n"
+              "    <prefer><family>sans-serif</family></prefer>\n"
+              "  </alias>\n", index);
+      break;
+    case 1:
+      fprintf(file,
+              "  <match target=\"font\">\n"
+              "    <test name=\"pixelsize\" compare=\"less\">"
+              "<double>%d</double></test>\n"
+              "    <edit name=\"hintstyle\" mode=\"assign\">"
+              "<const>hintslight</const></edit>\n"
+              "  </match>\n", 8 + index % 16);
+      break;
+    default:
+      fprintf(file,
+              "  <match target=\"pattern\">\n"
+              "    <test name=\"lang\" compare=\"contains\">"
+              "<string>%s</string></test>\n"
+              "    <edit name=\"family\" mode=\"prepend\">"
+              "<string>Synthetic Alias %d</string></edit>\n"
+              "  </match>\n",
+              kSyntheticRuleLangs[index / 3 % (sizeof(kSyntheticRuleLangs) /
+                                               sizeof(*kSyntheticRuleLangs))],
+              index - 2);
+      break;
+  }
+  fprintf(file, "</fontconfig>\n");
+}
+
+// Generates sets of 10, 100, ..., up to |max_rules| synthetic conf.d snippets
+// in |dir| on top of the default config, and measures loading the config,
+// FcConfigSubstitute() and a full match for |query| at each step.
+void RunConfigScaling(const BenchmarkOptions* options,
+                      const char* dir,
+                      FcPattern* query,
+                      int max_rules) {
+  char conf_dir[PATH_MAX], config_path[PATH_MAX];
+  snprintf(conf_dir, sizeof(conf_dir), "%s/conf.d", dir);
+  snprintf(config_path, sizeof(config_path), "%s/fonts.conf", dir);
+  FcChar8* default_config = FcConfigFilename(NULL);
+  FILE* config_file = NULL;
+  int ok = 1;
+  if (!default_config || !MakeParentDirs(config_path) ||
+      mkdir(conf_dir, 0755) != 0 || !(config_file = fopen(config_path, "w"))) {
+    fprintf(stderr, "Failed to set up %s; it must not already exist\n", dir);
+    ok = 0;
+  } else {
+    fprintf(config_file,
+            "<?xml version=\"1.0\"?>\n"
+            "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+            "<fontconfig>\n"
+            "  <include>%s</include>\n"
+            "  <include>%s</include>\n"
+            "</fontconfig>\n", default_config, conf_dir);
+    fclose(config_file);
+  }
+  if (default_config)
+    FcStrFree(default_config);
+
+  printf("Config rule scaling (%s):\n", dir);
+  printf("%-8s %-12s %-12s %s\n", "rules", "init", "substitute", "match");
+  int num_rules = 0;
+  for (int step = 10; ok && step <= max_rules;
+       step = GetNextScalingStep(step, max_rules)) {
+    for (; num_rules < step; num_rules++) {
+      char path[PATH_MAX + 32];
+      snprintf(path, sizeof(path), "%s/%06d-synthetic.conf", conf_dir,
+               num_rules);
+      FILE* file = fopen(path, "w");
+      if (!file) {
+        perror(path);
+        ok = 0;
+        break;
+      }
+      WriteSyntheticConfigRule(file, num_rules);
+      fclose(file);
+    }
+
+    ScalingBenchmarkData data = { config_path, NULL, query };
+    data.config = ok ? LoadFontconfigConfig(config_path) : NULL;
+    if (!data.config) {
+      printf("[failed to load %s]\n", config_path);
+      break;
+    }
+
+    double times[3];
+    times[0] = RunScalingBenchmark(options, "config", "init", num_rules,
+                                   RunScalingInitIteration, &data);
+    times[1] = RunScalingBenchmark(options, "config", "substitute", num_rules,
+                                   RunScalingSubstituteIteration, &data);
+    times[2] = RunScalingBenchmark(options, "config", "match", num_rules,
+                                   RunScalingFullMatchIteration, &data);
+    printf("%-8d", num_rules);
+    for (int i = 0; i < 3; i++) {
+      char str[32];
+      FormatDuration(times[i], str, sizeof(str));
+      printf(i < 2 ? " %-12s" : " %s", str);
+    }
+    printf("\n");
+    fflush(stdout);
+    FcConfigDestroy(data.config);
+  }
+  printf("\n");
+}
+
+// Objects holding rendering settings. The flattened config sets these on
+// matched fonts rather than on queries.
+const char* kRenderingObjects[] = {
+  FC_ANTIALIAS, FC_HINTING, FC_HINT_STYLE, FC_AUTOHINT, FC_RGBA,
+  FC_LCD_FILTER, FC_EMBEDDED_BITMAP, FC_EMBOLDEN,
+};
+#define NUM_RENDERING_OBJECTS \
+  ((int) (sizeof(kRenderingObjects) / sizeof(*kRenderingObjects)))
+
+// Properties of matched fonts that font rules may change, such as the matrix
+// and slant of a synthetic oblique. The flattened config only sets these where
+// the config changed them.
+const char* kFontPropertyObjects[] = { FC_MATRIX, FC_SLANT, FC_WEIGHT };
+#define NUM_FONT_PROPERTY_OBJECTS \
+  ((int) (sizeof(kFontPropertyObjects) / sizeof(*kFontPropertyObjects)))
+
+// Queries flattened when no --workload is given.
+const char* kDefaultFlattenWorkload[] = {
+  "sans-serif 10", "sans-serif Bold 10", "sans-serif Italic 10",
+  "sans-serif 13px", "serif 10", "serif Bold 10", "monospace 10",
+  "monospace Bold 10", "system-ui 10",
+};
+
+// Family used to find the fallbacks that the config appends to families that
+// aren't in the workload.
+#define FLATTEN_UNKNOWN_FAMILY "font-config-info unknown family"
+
+// Custom object that the flattened config sets on queries once one of their
+// rules has fired, so that families in a rewritten list don't fire more rules.
+#define FLATTEN_MARKER "flattened"
+
+// Size of the buffers that edits and rules are formatted into.
+#define FLATTEN_BUFFER_SIZE (256 * 1024)
+
+// A workload query and its results under the config being flattened.
+typedef struct {
+  char desc[128];
+  FcPattern* query;        // As requested.
+  FcPattern* defaults;     // With only FcDefaultSubstitute() applied.
+  FcPattern* substituted;  // With the config's pattern rules applied.
+  FcPattern* match;
+  FcPattern* unprepared;   // |match| as it would be without font rules.
+  char* pattern_edits;     // Pattern edits not shared by all queries.
+  char* font_edits;        // Rendering edits differing from the defaults.
+} FlattenQuery;
+
+// Compares family names as Fontconfig does, ignoring ASCII case and spaces.
+int CompareFamilyStrings(const FcChar8* a, const FcChar8* b) {
+  while (1) {
+    while (*a == ' ')
+      a++;
+    while (*b == ' ')
+      b++;
+    const int a_char = *a >= 'A' && *a <= 'Z' ? *a + 'a' - 'A' : *a;
+    const int b_char = *b >= 'A' && *b <= 'Z' ? *b + 'a' - 'A' : *b;
+    if (a_char != b_char || !a_char)
+      return a_char - b_char;
+    a++;
+    b++;
+  }
+}
+
+int CompareFamilyNames(const void* a, const void* b) {
+  return CompareFamilyStrings(*(const FcChar8* const*) a,
+                              *(const FcChar8* const*) b);
+}
+
+// Returns a sorted array of the family names of |config|'s fonts, storing its
+// length in |num_families|. The names are owned by |config|.
+const FcChar8** GetInstalledFamilies(FcConfig* config, int* num_families) {
+  const FcChar8** families = NULL;
+  int capacity = 0;
+  *num_families = 0;
+  const FcSetName kSets[] = { FcSetSystem, FcSetApplication };
+  for (int i = 0; i < 2; i++) {
+    FcFontSet* fonts = FcConfigGetFonts(config, kSets[i]);
+    for (int j = 0; fonts && j < fonts->nfont; j++) {
+      FcChar8* family = NULL;
+      for (int k = 0; FcPatternGetString(fonts->fonts[j], FC_FAMILY, k,
+                                         &family) == FcResultMatch; k++) {
+        if (*num_families == capacity) {
+          capacity = capacity ? capacity * 2 : 256;
+          families = realloc(families, capacity * sizeof(*families));
+          assert(families);
+        }
+        families[(*num_families)++] = family;
+      }
+    }
+  }
+  if (families)
+    qsort(families, *num_families, sizeof(*families), CompareFamilyNames);
+  return families;
+}
+
+// Appends |str| to |arena| with XML special characters escaped. Returns false
+// if |arena| is full.
+int AppendXmlText(OutputArena* arena, const char* str) {
+  int ok = 1;
+  for (; ok && *str; str++) {
+    switch (*str) {
+      case '&': ok = ArenaPrintf(arena, "&amp;"); break;
+      case '<': ok = ArenaPrintf(arena, "&lt;"); break;
+      case '>': ok = ArenaPrintf(arena, "&gt;"); break;
+      case '"': ok = ArenaPrintf(arena, "&quot;"); break;
+      default: ok = ArenaPrintf(arena, "%c", *str); break;
+    }
+  }
+  return ok;
+}
+
+// Appends |value| to |arena| as a config expression. Returns false if its type
+// can't be written in a config or |arena| is full.
+int AppendConfigValue(OutputArena* arena, FcValue value) {
+  switch (value.type) {
+    case FcTypeInteger:
+      return ArenaPrintf(arena, "<int>%d</int>", value.u.i);
+    case FcTypeDouble:
+      // Enough digits to read back the same double, since tests compare
+      // values exactly.
+      return ArenaPrintf(arena, "<double>%.17g</double>", value.u.d);
+    case FcTypeBool:
+      if (value.u.b != FcTrue && value.u.b != FcFalse)
+        return 0;
+      return ArenaPrintf(arena, "<bool>%s</bool>",
+                         value.u.b ? "true" : "false");
+    case FcTypeString:
+      return ArenaPrintf(arena, "<string>") &&
+          AppendXmlText(arena, (const char*) value.u.s) &&
+          ArenaPrintf(arena, "</string>");
+    case FcTypeMatrix:
+      return ArenaPrintf(arena,
+                         "<matrix><double>%.17g</double><double>%.17g</double>"
+                         "<double>%.17g</double><double>%.17g</double>"
+                         "</matrix>",
+                         value.u.m->xx, value.u.m->xy, value.u.m->yx,
+                         value.u.m->yy);
+    default:
+      return 0;
+  }
+}
+
+const char* GetBindingString(FcValueBinding binding) {
+  switch (binding) {
+    case FcValueBindingWeak:
+      return "weak";
+    case FcValueBindingStrong:
+      return "strong";
+    default:
+      return "same";
+  }
+}
+
+// Returns a new array of flags saying which values of |object| in |pattern|
+// to keep when flattening, storing the number of values in |num_values|. With
+// |families|, strings naming families that aren't installed and values
+// repeating an earlier kept value with the same binding are dropped; neither
+// changes how fonts are scored.
+int* GetFlattenedValuesKept(FcPattern* pattern,
+                            const char* object,
+                            const FcChar8** families,
+                            int num_families,
+                            int* num_values) {
+  FcValue value;
+  FcValueBinding binding;
+  *num_values = 0;
+  while (FcPatternGetWithBinding(pattern, object, *num_values, &value,
+                                 &binding) == FcResultMatch)
+    (*num_values)++;
+  int* kept = malloc((*num_values + 1) * sizeof(int));
+  assert(kept);
+  for (int i = 0; i < *num_values; i++) {
+    FcPatternGetWithBinding(pattern, object, i, &value, &binding);
+    kept[i] = !families || value.type != FcTypeString ||
+        bsearch(&value.u.s, families, num_families, sizeof(*families),
+                CompareFamilyNames);
+    for (int j = 0; families && kept[i] && j < i; j++) {
+      FcValue other;
+      FcValueBinding other_binding;
+      FcPatternGetWithBinding(pattern, object, j, &other, &other_binding);
+      kept[i] = !kept[j] || other_binding != binding ||
+          !FcValueEqual(other, value);
+    }
+  }
+  return kept;
+}
+
+// Appends edits to |arena| that give |object| the values it has in |pattern|,
+// with their bindings, or that delete it if |pattern| doesn't have it. The
+// first edit uses |mode| and the rest append to it. Values are filtered as
+// described for GetFlattenedValuesKept(). Returns false if a value can't be
+// written in a config or |arena| is full.
+int AppendObjectEdits(OutputArena* arena,
+                      FcPattern* pattern,
+                      const char* object,
+                      const char* mode,
+                      const FcChar8** families,
+                      int num_families) {
+  FcValue value;
+  FcValueBinding binding = FcValueBindingWeak, group_binding = binding;
+  int num_values = 0, num_written = 0, ok = 1;
+  int* kept = GetFlattenedValuesKept(pattern, object, families, num_families,
+                                     &num_values);
+  for (int i = 0; ok && i < num_values; i++) {
+    if (!kept[i])
+      continue;
+    FcPatternGetWithBinding(pattern, object, i, &value, &binding);
+    if (num_written == 0 || binding != group_binding) {
+      ok = (num_written == 0 || ArenaPrintf(arena, "</edit>\n")) &&
+          ArenaPrintf(arena, "    <edit name=\"%s\" mode=\"%s\" "
+                      "binding=\"%s\">", object,
+                      num_written == 0 ? mode : "append_last",
+                      GetBindingString(binding));
+      group_binding = binding;
+    }
+    ok = ok && AppendConfigValue(arena, value);
+    num_written++;
+  }
+  free(kept);
+  if (!ok)
+    return 0;
+  if (num_written > 0)
+    return ArenaPrintf(arena, "</edit>\n");
+  if (strcmp(mode, "append_last") == 0)
+    return 1;
+  return ArenaPrintf(arena, "    <edit name=\"%s\" mode=\"delete_all\"/>\n",
+                     object);
+}
+
+// Returns the edits that give |object| its values in |to| when it starts with
+// those in |from|, or NULL if no edits are needed or they can't be written.
+// |buffer| is scratch space of FLATTEN_BUFFER_SIZE bytes.
+char* GetObjectDelta(FcPattern* from,
+                     FcPattern* to,
+                     const char* object,
+                     const FcChar8** families,
+                     int num_families,
+                     char* buffer) {
+  OutputArena from_edits = { buffer, FLATTEN_BUFFER_SIZE / 2, 0 };
+  OutputArena to_edits = { buffer + FLATTEN_BUFFER_SIZE / 2,
+                           FLATTEN_BUFFER_SIZE / 2, 0 };
+  if (!AppendObjectEdits(&to_edits, to, object, "assign_replace", families,
+                         num_families)) {
+    fprintf(stderr, "Can't flatten values of \"%s\"\n", object);
+    return NULL;
+  }
+  if (AppendObjectEdits(&from_edits, from, object, "assign_replace", NULL, 0) &&
+      strcmp(from_edits.data, to_edits.data) == 0)
+    return NULL;
+  char* delta = strdup(to_edits.data);
+  assert(delta);
+  return delta;
+}
+
+// Returns whether FcDefaultSubstitute() derives |object|'s value in
+// |substituted| from the other size, which is the case for whichever of the
+// point and pixel sizes |query| didn't specify.
+int IsDerivedSize(FcPattern* query, FcPattern* substituted,
+                  const char* object) {
+  FcValue value;
+  if ((strcmp(object, FC_SIZE) != 0 && strcmp(object, FC_PIXEL_SIZE) != 0) ||
+      FcPatternGet(query, object, 0, &value) == FcResultMatch)
+    return 0;
+  double size = 0.0, pixel_size = 0.0, dpi = 75.0, scale = 1.0;
+  if (FcPatternGetDouble(substituted, FC_SIZE, 0, &size) != FcResultMatch ||
+      FcPatternGetDouble(substituted, FC_PIXEL_SIZE, 0, &pixel_size) !=
+      FcResultMatch)
+    return 0;
+  FcPatternGetDouble(substituted, FC_DPI, 0, &dpi);
+  FcPatternGetDouble(substituted, FC_SCALE, 0, &scale);
+  return fabs(size * scale * dpi / 72.0 - pixel_size) <= 1e-9 * pixel_size;
+}
+
+// Returns whether |object| holds rendering settings.
+int IsRenderingObject(const char* object) {
+  for (int i = 0; i < NUM_RENDERING_OBJECTS; i++) {
+    if (strcmp(object, kRenderingObjects[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Adds the objects in |pattern| that aren't already in |objects| to it.
+void AddPatternObjects(FcPattern* pattern,
+                       const char*** objects,
+                       int* num_objects) {
+  FcPatternIter iter;
+  FcPatternIterStart(pattern, &iter);
+  for (int valid = FcPatternIterIsValid(pattern, &iter); valid;
+       valid = FcPatternIterNext(pattern, &iter)) {
+    const char* object = FcPatternIterGetObject(pattern, &iter);
+    int found = 0;
+    for (int i = 0; !found && i < *num_objects; i++)
+      found = strcmp((*objects)[i], object) == 0;
+    if (!found) {
+      *objects = realloc(*objects, (*num_objects + 1) * sizeof(char*));
+      assert(*objects);
+      (*objects)[(*num_objects)++] = object;
+    }
+  }
+}
+
+// Appends a test to |arena| that |object| of the rule's |target| ("pattern" or
+// "font") equals its first value in |pattern|. Nothing is appended if
+// |pattern| doesn't have |object|.
+int AppendQueryTest(OutputArena* arena,
+                    FcPattern* pattern,
+                    const char* object,
+                    const char* target) {
+  FcValue value;
+  if (FcPatternGet(pattern, object, 0, &value) != FcResultMatch)
+    return 1;
+  return ArenaPrintf(arena, "    <test target=\"%s\" name=\"%s\">", target,
+                     object) &&
+      AppendConfigValue(arena, value) &&
+      ArenaPrintf(arena, "</test>\n");
+}
+
+// Appends a pattern rule with |tests| and |edits| that only fires once per
+// query.
+int AppendMarkedPatternRule(OutputArena* arena,
+                            const char* tests,
+                            const char* edits) {
+  return ArenaPrintf(arena,
+                     "  <match target=\"pattern\">\n"
+                     "    <test qual=\"all\" name=\"" FLATTEN_MARKER "\" "
+                     "compare=\"not_eq\"><bool>true</bool></test>\n"
+                     "%s%s"
+                     "    <edit name=\"" FLATTEN_MARKER "\" mode=\"assign\">"
+                     "<bool>true</bool></edit>\n"
+                     "  </match>\n", tests, edits);
+}
+
+// Returns the number of properties set in |pattern|.
+int CountPatternObjects(FcPattern* pattern) {
+  int num_objects = 0;
+  FcPatternIter iter;
+  FcPatternIterStart(pattern, &iter);
+  for (int valid = FcPatternIterIsValid(pattern, &iter); valid;
+       valid = FcPatternIterNext(pattern, &iter))
+    num_objects++;
+  return num_objects;
+}
+
+// Appends the pattern rules reproducing |config|'s substitutions for the
+// |num_queries| queries in |queries| to |arena|, and returns the number of
+// rules, or -1 if |arena| is full. Family rewrites are grouped by requested
+// family, falling back to one rule per query when queries for a family are
+// rewritten differently. Edits that every query gets are made by a single rule
+// without tests, and families outside the workload get the fallbacks that
+// |config| appends to unknown families.
+int AppendFlattenedPatternRules(OutputArena* arena,
+                                FcConfig* config,
+                                FlattenQuery* queries,
+                                int num_queries,
+                                const FcChar8** families,
+                                int num_families) {
+  char* buffer = malloc(FLATTEN_BUFFER_SIZE);
+  assert(buffer);
+  const char** objects = NULL;
+  int num_objects = 0;
+  for (int i = 0; i < num_queries; i++) {
+    AddPatternObjects(queries[i].defaults, &objects, &num_objects);
+    AddPatternObjects(queries[i].substituted, &objects, &num_objects);
+  }
+
+  // Find each query's edits per object, and which of those are shared.
+  char** deltas = calloc((size_t) num_queries * (num_objects + 1),
+                         sizeof(char*));
+  int* shared = calloc(num_objects + 1, sizeof(int));
+  assert(deltas && shared);
+  for (int j = 0; j < num_objects; j++) {
+    if (IsRenderingObject(objects[j]))
+      continue;
+    const int is_family = strcmp(objects[j], FC_FAMILY) == 0;
+    shared[j] = !is_family;
+    for (int i = 0; i < num_queries; i++) {
+      char** delta = &deltas[i * num_objects + j];
+      if (!IsDerivedSize(queries[i].query, queries[i].substituted,
+                         objects[j])) {
+        *delta = GetObjectDelta(queries[i].defaults, queries[i].substituted,
+                                objects[j], is_family ? families : NULL,
+                                num_families, buffer);
+      }
+      shared[j] = shared[j] && *delta &&
+          (i == 0 || strcmp(*delta, deltas[j]) == 0);
+    }
+  }
+  for (int i = 0; i < num_queries; i++) {
+    OutputArena edits = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+    buffer[0] = '\0';
+    for (int j = 0; j < num_objects; j++) {
+      if (!shared[j] && deltas[i * num_objects + j])
+        ArenaPrintf(&edits, "%s", deltas[i * num_objects + j]);
+    }
+    queries[i].pattern_edits = strdup(buffer);
+    assert(queries[i].pattern_edits);
+  }
+
+  int num_rules = 0, ok = 1;
+  char* tests = malloc(FLATTEN_BUFFER_SIZE);
+  assert(tests);
+  int* done = calloc(num_queries, sizeof(int));
+  assert(done);
+  for (int i = 0; i < num_queries; i++) {
+    if (done[i])
+      continue;
+    FcChar8* family = NULL;
+    FcPatternGetString(queries[i].query, FC_FAMILY, 0, &family);
+
+    // Find the queries for this family, most specific first, and check whether
+    // they're all edited the same way.
+    int* group = malloc(num_queries * sizeof(int));
+    assert(group);
+    int group_size = 0, uniform = 1;
+    for (int j = i; j < num_queries; j++) {
+      FcChar8* other_family = NULL;
+      FcPatternGetString(queries[j].query, FC_FAMILY, 0, &other_family);
+      if (done[j] || CompareFamilyStrings(family, other_family) != 0)
+        continue;
+      done[j] = 1;
+      uniform = uniform && strcmp(queries[j].pattern_edits,
+                                  queries[i].pattern_edits) == 0;
+      int k = group_size++;
+      const int num_tests = CountPatternObjects(queries[j].query);
+      for (; k > 0 && CountPatternObjects(queries[group[k - 1]].query) <
+           num_tests; k--)
+        group[k] = group[k - 1];
+      group[k] = j;
+    }
+
+    for (int j = 0; j < group_size; j++) {
+      FlattenQuery* query = &queries[group[j]];
+      if (uniform && (j > 0 || !query->pattern_edits[0]))
+        break;
+      int duplicate = 0;
+      for (int k = 0; !uniform && !duplicate && k < j; k++)
+        duplicate = strcmp(queries[group[k]].desc, query->desc) == 0;
+      if (duplicate)
+        continue;
+      OutputArena test_arena = { tests, FLATTEN_BUFFER_SIZE, 0 };
+      tests[0] = '\0';
+      FcPatternIter iter;
+      FcPatternIterStart(query->query, &iter);
+      for (int valid = FcPatternIterIsValid(query->query, &iter); valid;
+           valid = FcPatternIterNext(query->query, &iter)) {
+        const char* object = FcPatternIterGetObject(query->query, &iter);
+        if (!uniform || strcmp(object, FC_FAMILY) == 0)
+          AppendQueryTest(&test_arena, query->query, object, "pattern");
+      }
+      ok = AppendMarkedPatternRule(arena, tests, query->pattern_edits) && ok;
+      num_rules++;
+    }
+    free(group);
+  }
+  free(done);
+  free(tests);
+
+  // Give other families the config's fallbacks.
+  FcPattern* unknown = FcPatternCreate();
+  assert(unknown);
+  FcPatternAddString(unknown, FC_FAMILY,
+                     (const FcChar8*) FLATTEN_UNKNOWN_FAMILY);
+  FcConfigSubstitute(config, unknown, FcMatchPattern);
+  OutputArena fallbacks = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+  buffer[0] = '\0';
+  if (AppendObjectEdits(&fallbacks, unknown, FC_FAMILY, "append_last",
+                        families, num_families) && buffer[0]) {
+    ok = AppendMarkedPatternRule(arena, "", buffer) && ok;
+    num_rules++;
+  }
+  FcPatternDestroy(unknown);
+
+  // Make the shared edits last so that earlier rules test queries as they
+  // were requested.
+  OutputArena shared_edits = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+  buffer[0] = '\0';
+  for (int j = 0; num_queries > 0 && j < num_objects; j++) {
+    if (shared[j])
+      ArenaPrintf(&shared_edits, "%s", deltas[j]);
+  }
+  if (buffer[0]) {
+    ok = ArenaPrintf(arena, "  <match target=\"pattern\">\n%s  </match>\n",
+                     buffer) && ok;
+    num_rules++;
+  }
+
+  for (int i = 0; i < num_queries * num_objects; i++)
+    free(deltas[i]);
+  free(deltas);
+  free(shared);
+  free(objects);
+  free(buffer);
+  return ok ? num_rules : -1;
+}
+
+// Returns whether |object| has the same values in |a| and |b|.
+int HaveSameValues(FcPattern* a, FcPattern* b, const char* object) {
+  FcValue a_value, b_value;
+  int i = 0;
+  for (; FcPatternGet(a, object, i, &a_value) == FcResultMatch; i++) {
+    if (FcPatternGet(b, object, i, &b_value) != FcResultMatch ||
+        !FcValueEqual(a_value, b_value))
+      return 0;
+  }
+  return FcPatternGet(b, object, i, &b_value) != FcResultMatch;
+}
+
+// Appends the font rules reproducing the rendering settings of |queries|'
+// matches, and the font properties that the config changed, to |arena|.
+// Returns the number of rules or -1 if |arena| is full. The most common value
+// of each rendering setting is assigned to every font, and fonts that differ
+// get rules testing their family, or their file if fonts in a family differ.
+// Changed font properties, such as the matrix of a synthetic oblique, and
+// settings that differ between requests for the same file get rules that also
+// test the requested slant, weight and size.
+int AppendFlattenedFontRules(OutputArena* arena,
+                             FlattenQuery* queries,
+                             int num_queries) {
+  char* buffer = malloc(FLATTEN_BUFFER_SIZE);
+  char* scratch = malloc(FLATTEN_BUFFER_SIZE);
+  char** values = calloc((size_t) num_queries * NUM_RENDERING_OBJECTS,
+                         sizeof(char*));
+  assert(buffer && scratch && values);
+  for (int i = 0; i < num_queries; i++) {
+    for (int j = 0; j < NUM_RENDERING_OBJECTS; j++) {
+      OutputArena edits = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+      buffer[0] = '\0';
+      if (!AppendObjectEdits(&edits, queries[i].match, kRenderingObjects[j],
+                             "assign_replace", NULL, 0))
+        fprintf(stderr, "Can't flatten values of \"%s\"\n",
+                kRenderingObjects[j]);
+      values[i * NUM_RENDERING_OBJECTS + j] = strdup(buffer);
+      assert(values[i * NUM_RENDERING_OBJECTS + j]);
+    }
+  }
+
+  // Find the most common value of each setting.
+  int num_rules = 0, ok = 1;
+  const char* defaults[NUM_RENDERING_OBJECTS];
+  OutputArena default_edits = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+  buffer[0] = '\0';
+  for (int j = 0; j < NUM_RENDERING_OBJECTS; j++) {
+    int best_count = 0;
+    defaults[j] = "";
+    for (int i = 0; i < num_queries; i++) {
+      const char* value = values[i * NUM_RENDERING_OBJECTS + j];
+      int count = 0;
+      for (int k = 0; k < num_queries; k++)
+        count += strcmp(values[k * NUM_RENDERING_OBJECTS + j], value) == 0;
+      if (count > best_count) {
+        best_count = count;
+        defaults[j] = value;
+      }
+    }
+    if (!strstr(defaults[j], "delete_all"))
+      ArenaPrintf(&default_edits, "%s", defaults[j]);
+  }
+  if (buffer[0]) {
+    ok = ArenaPrintf(arena, "  <match target=\"font\">\n%s  </match>\n",
+                     buffer) && ok;
+    num_rules++;
+  }
+
+  int* per_request = calloc(num_queries, sizeof(int));
+  assert(per_request);
+  for (int i = 0; i < num_queries; i++) {
+    OutputArena edits = { buffer, FLATTEN_BUFFER_SIZE, 0 };
+    buffer[0] = '\0';
+    for (int j = 0; j < NUM_RENDERING_OBJECTS; j++) {
+      if (strcmp(values[i * NUM_RENDERING_OBJECTS + j], defaults[j]) != 0)
+        ArenaPrintf(&edits, "%s", values[i * NUM_RENDERING_OBJECTS + j]);
+    }
+    for (int j = 0; j < NUM_FONT_PROPERTY_OBJECTS; j++) {
+      if (HaveSameValues(queries[i].unprepared, queries[i].match,
+                         kFontPropertyObjects[j]))
+        continue;
+      char* delta = GetObjectDelta(queries[i].unprepared, queries[i].match,
+                                   kFontPropertyObjects[j], NULL, 0, scratch);
+      if (delta)
+        ArenaPrintf(&edits, "%s", delta);
+      free(delta);
+      per_request[i] = 1;
+    }
+    queries[i].font_edits = strdup(buffer);
+    assert(queries[i].font_edits);
+  }
+
+  // Group exceptions by family, then by file.
+  char* tests = malloc(FLATTEN_BUFFER_SIZE);
+  int* done = calloc(num_queries, sizeof(int));
+  assert(tests && done);
+  for (int i = 0; i < num_queries; i++) {
+    if (done[i])
+      continue;
+    FcChar8 *family = NULL, *file = NULL;
+    int index = 0;
+    FcPatternGetString(queries[i].match, FC_FAMILY, 0, &family);
+    FcPatternGetString(queries[i].match, FC_FILE, 0, &file);
+    FcPatternGetInteger(queries[i].match, FC_INDEX, 0, &index);
+    int same_family = !per_request[i], same_file = !per_request[i];
+    for (int j = i + 1; j < num_queries; j++) {
+      FcChar8 *other_family = NULL, *other_file = NULL;
+      int other_index = 0;
+      FcPatternGetString(queries[j].match, FC_FAMILY, 0, &other_family);
+      FcPatternGetString(queries[j].match, FC_FILE, 0, &other_file);
+      FcPatternGetInteger(queries[j].match, FC_INDEX, 0, &other_index);
+      const int differs = per_request[j] ||
+          strcmp(queries[j].font_edits, queries[i].font_edits) != 0;
+      if (family && other_family && FcStrCmp(family, other_family) == 0)
+        same_family = same_family && !differs;
+      if (file && other_file && FcStrCmp(file, other_file) == 0 &&
+          index == other_index)
+        same_file = same_file && !differs;
+    }
+
+    for (int j = i; j < num_queries; j++) {
+      FcChar8 *other_family = NULL, *other_file = NULL;
+      int other_index = 0;
+      FcPatternGetString(queries[j].match, FC_FAMILY, 0, &other_family);
+      FcPatternGetString(queries[j].match, FC_FILE, 0, &other_file);
+      FcPatternGetInteger(queries[j].match, FC_INDEX, 0, &other_index);
+      if ((same_family && family && other_family &&
+           FcStrCmp(family, other_family) == 0) ||
+          (!same_family && same_file && file && other_file &&
+           FcStrCmp(file, other_file) == 0 && index == other_index))
+        done[j] = 1;
+    }
+    done[i] = 1;
+    if (!queries[i].font_edits[0])
+      continue;
+
+    OutputArena test_arena = { tests, FLATTEN_BUFFER_SIZE, 0 };
+    tests[0] = '\0';
+    if (same_family) {
+      AppendQueryTest(&test_arena, queries[i].match, FC_FAMILY, "font");
+    } else {
+      AppendQueryTest(&test_arena, queries[i].match, FC_FILE, "font");
+      AppendQueryTest(&test_arena, queries[i].match, FC_INDEX, "font");
+      if (!same_file) {
+        AppendQueryTest(&test_arena, queries[i].substituted, FC_SLANT,
+                        "pattern");
+        AppendQueryTest(&test_arena, queries[i].substituted, FC_WEIGHT,
+                        "pattern");
+        AppendQueryTest(&test_arena, queries[i].substituted, FC_PIXEL_SIZE,
+                        "pattern");
+      }
+    }
+    ok = ArenaPrintf(arena, "  <match target=\"font\">\n%s%s  </match>\n",
+                     tests, queries[i].font_edits) && ok;
+    num_rules++;
+  }
+
+  for (int i = 0; i < num_queries * NUM_RENDERING_OBJECTS; i++)
+    free(values[i]);
+  free(values);
+  free(per_request);
+  free(done);
+  free(tests);
+  free(scratch);
+  free(buffer);
+  return ok ? num_rules : -1;
+}
+
+// Returns the font in |config|'s font set that |match| was prepared from, or
+// NULL if it isn't found.
+FcPattern* FindConfigFont(FcConfig* config, FcPattern* match) {
+  FcChar8* file = NULL;
+  int index = 0;
+  if (FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
+    return NULL;
+  FcPatternGetInteger(match, FC_INDEX, 0, &index);
+  FcFontSet* fonts = FcConfigGetFonts(config, FcSetSystem);
+  for (int i = 0; fonts && i < fonts->nfont; i++) {
+    FcChar8* font_file = NULL;
+    int font_index = 0;
+    FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &font_index);
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &font_file) ==
+        FcResultMatch && font_index == index && FcStrCmp(file, font_file) == 0)
+      return fonts->fonts[i];
+  }
+  return NULL;
+}
+
+// Returns a new sorted array of "FILE:INDEX" keys for |config|'s fonts,
+// storing its length in |num_keys|.
+char** GetFontKeys(FcConfig* config, int* num_keys) {
+  FcFontSet* fonts = FcConfigGetFonts(config, FcSetSystem);
+  *num_keys = 0;
+  char** keys = calloc(fonts ? fonts->nfont + 1 : 1, sizeof(char*));
+  assert(keys);
+  for (int i = 0; fonts && i < fonts->nfont; i++) {
+    FcChar8* file = NULL;
+    int index = 0;
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &file) !=
+        FcResultMatch)
+      continue;
+    FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &index);
+    if (asprintf(&keys[*num_keys], "%s:%d", file, index) < 0)
+      keys[*num_keys] = NULL;
+    assert(keys[*num_keys]);
+    (*num_keys)++;
+  }
+  qsort(keys, *num_keys, sizeof(char*), CompareStrings);
+  return keys;
+}
+
+// Returns whether |dir| is |parent| or inside it.
+int IsSubdirectory(const char* dir, const char* parent) {
+  const size_t len = strlen(parent);
+  return strncmp(dir, parent, len) == 0 &&
+      (dir[len] == '\0' || dir[len] == '/' ||
+       (len > 0 && parent[len - 1] == '/'));
+}
+
+// Returns a new array of |config|'s font dirs, leaving out the subdirs that
+// Fontconfig adds while scanning them, and stores its length in |num_dirs|.
+char** GetTopLevelFontDirs(FcConfig* config, int* num_dirs) {
+  FcStrList* font_dirs = FcConfigGetFontDirs(config);
+  char** all_dirs = NULL;
+  int num_all_dirs = 0;
+  FcChar8* font_dir = NULL;
+  while ((font_dir = FcStrListNext(font_dirs))) {
+    all_dirs = realloc(all_dirs, (num_all_dirs + 1) * sizeof(char*));
+    assert(all_dirs);
+    all_dirs[num_all_dirs++] = (char*) font_dir;
+  }
+
+  char** dirs = calloc(num_all_dirs + 1, sizeof(char*));
+  assert(dirs);
+  *num_dirs = 0;
+  for (int i = 0; i < num_all_dirs; i++) {
+    int nested = 0;
+    for (int j = 0; !nested && j < num_all_dirs; j++) {
+      nested = strcmp(all_dirs[i], all_dirs[j]) != 0 &&
+          IsSubdirectory(all_dirs[i], all_dirs[j]);
+    }
+    if (!nested) {
+      dirs[*num_dirs] = strdup(all_dirs[i]);
+      assert(dirs[*num_dirs]);
+      (*num_dirs)++;
+    }
+  }
+  FcStrListDone(font_dirs);
+  free(all_dirs);
+  return dirs;
+}
+
+// Adds the number of fonts cached for |dir| and its subdirs to |num_fonts|
+// and the number of those among the |num_keys| accepted fonts in |keys| to
+// |num_accepted|, and appends rejections of the others to |rejects|. Returns
+// false if |rejects| is full.
+int ScanFlattenedFontDir(FcConfig* config,
+                         const FcChar8* dir,
+                         char** keys,
+                         int num_keys,
+                         OutputArena* rejects,
+                         int* num_fonts,
+                         int* num_accepted) {
+  FcCache* cache = FcDirCacheLoad(dir, config, NULL);
+  if (!cache)
+    return 1;
+  FcFontSet* fonts = FcCacheCopySet(cache);
+  int ok = 1;
+  for (int i = 0; ok && fonts && i < fonts->nfont; i++) {
+    FcChar8* file = NULL;
+    int index = 0;
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &file) !=
+        FcResultMatch)
+      continue;
+    FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &index);
+    char key[PATH_MAX + 16];
+    const char* key_ptr = key;
+    snprintf(key, sizeof(key), "%s:%d", file, index);
+    (*num_fonts)++;
+    if (bsearch(&key_ptr, keys, num_keys, sizeof(char*), CompareStrings)) {
+      (*num_accepted)++;
+      continue;
+    }
+
+    // Reject the whole file at its first face if none of its faces were
+    // accepted, or just this face otherwise.
+    int file_rejected = 1, first_face = 1;
+    for (int j = 0; j < fonts->nfont; j++) {
+      FcChar8* other_file = NULL;
+      int other_index = 0;
+      if (j == i || FcPatternGetString(fonts->fonts[j], FC_FILE, 0,
+                                       &other_file) != FcResultMatch ||
+          FcStrCmp(file, other_file) != 0)
+        continue;
+      FcPatternGetInteger(fonts->fonts[j], FC_INDEX, 0, &other_index);
+      snprintf(key, sizeof(key), "%s:%d", other_file, other_index);
+      if (bsearch(&key_ptr, keys, num_keys, sizeof(char*), CompareStrings))
+        file_rejected = 0;
+      if (j < i)
+        first_face = 0;
+    }
+    if (file_rejected && first_face && !strpbrk((const char*) file, "*?")) {
+      ok = ArenaPrintf(rejects, "      <glob>") &&
+          AppendXmlText(rejects, (const char*) file) &&
+          ArenaPrintf(rejects, "</glob>\n");
+    } else if (!file_rejected || strpbrk((const char*) file, "*?")) {
+      ok = ArenaPrintf(rejects,
+                       "      <pattern><patelt name=\"file\"><string>") &&
+          AppendXmlText(rejects, (const char*) file) &&
+          ArenaPrintf(rejects, "</string></patelt><patelt name=\"index\">"
+                      "<int>%d</int></patelt></pattern>\n", index);
+    }
+  }
+  for (int i = 0; ok && i < FcCacheNumSubdir(cache); i++) {
+    ok = ScanFlattenedFontDir(config, FcCacheSubdir(cache, i), keys, num_keys,
+                              rejects, num_fonts, num_accepted);
+  }
+  if (fonts)
+    FcFontSetDestroy(fonts);
+  FcDirCacheUnload(cache);
+  return ok;
+}
+
+// Appends the font dirs and cache dirs of |config| to |arena|, along with
+// rules rejecting the fonts in those dirs that |config| rejects. Dirs whose
+// fonts are all rejected are left out. Returns the number of dirs left out, or
+// -1 if |arena| or the reject list is full.
+int AppendFlattenedFontDirs(OutputArena* arena, FcConfig* config) {
+  int num_keys = 0;
+  char** keys = GetFontKeys(config, &num_keys);
+  char* rejects = malloc(FLATTEN_BUFFER_SIZE);
+  char* dir_rejects = malloc(FLATTEN_BUFFER_SIZE);
+  assert(rejects && dir_rejects);
+  OutputArena reject_arena = { rejects, FLATTEN_BUFFER_SIZE, 0 };
+  rejects[0] = '\0';
+  int num_skipped = 0, ok = 1;
+
+  int num_dirs = 0;
+  char** dirs = GetTopLevelFontDirs(config, &num_dirs);
+  for (int i = 0; ok && i < num_dirs; i++) {
+    int num_fonts = 0, num_accepted = 0;
+    OutputArena dir_reject_arena = { dir_rejects, FLATTEN_BUFFER_SIZE, 0 };
+    dir_rejects[0] = '\0';
+    // A truncated reject list would let rejected fonts back in.
+    if (!ScanFlattenedFontDir(config, (const FcChar8*) dirs[i], keys,
+                              num_keys, &dir_reject_arena, &num_fonts,
+                              &num_accepted)) {
+      ok = 0;
+    } else if (num_fonts > 0 && num_accepted == 0) {
+      num_skipped++;
+    } else {
+      ok = ArenaPrintf(arena, "  <dir>") &&
+          AppendXmlText(arena, (const char*) dirs[i]) &&
+          ArenaPrintf(arena, "</dir>\n") &&
+          ArenaPrintf(&reject_arena, "%s", dir_rejects) && ok;
+    }
+  }
+  for (int i = 0; i < num_dirs; i++)
+    free(dirs[i]);
+  free(dirs);
+
+  FcStrList* cache_dirs = FcConfigGetCacheDirs(config);
+  FcChar8* cache_dir = NULL;
+  while ((cache_dir = FcStrListNext(cache_dirs))) {
+    ok = ArenaPrintf(arena, "  <cachedir>") &&
+        AppendXmlText(arena, (const char*) cache_dir) &&
+        ArenaPrintf(arena, "</cachedir>\n") && ok;
+  }
+  FcStrListDone(cache_dirs);
+
+  if (rejects[0]) {
+    ok = ArenaPrintf(arena, "  <selectfont>\n    <rejectfont>\n%s"
+                     "    </rejectfont>\n  </selectfont>\n", rejects) && ok;
+  }
+
+  for (int i = 0; i < num_keys; i++)
+    free(keys[i]);
+  free(keys);
+  free(rejects);
+  free(dir_rejects);
+  return ok ? num_skipped : -1;
+}
+
+// Returns the number of <match> and <alias> rules in the config file at
+// |path|.
+int CountConfigFileRules(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+  int num_rules = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), file)) {
+    for (const char* tag = line; (tag = strchr(tag, '<')); tag++) {
+      if (strncmp(tag, "<match", 6) == 0 || strncmp(tag, "<alias", 6) == 0)
+        num_rules++;
+    }
+  }
+  fclose(file);
+  return num_rules;
+}
+
+// Formats the parts of |match| that the flattened config must reproduce into
+// |str|.
+void FormatFlattenResult(const char* desc,
+                         FcPattern* match,
+                         char* str,
+                         size_t size) {
+  FormatBatchResult(desc, match, str, size);
+  OutputArena arena = { str, size, strlen(str) };
+  for (int i = 0; i < NUM_RENDERING_OBJECTS; i++)
+    AppendObjectEdits(&arena, match, kRenderingObjects[i], "assign_replace",
+                      NULL, 0);
+  for (int i = 0; i < NUM_FONT_PROPERTY_OBJECTS; i++)
+    AppendObjectEdits(&arena, match, kFontPropertyObjects[i],
+                      "assign_replace", NULL, 0);
+}
+
+// State for benchmarking a workload against a config.
+typedef struct {
+  FcConfig* config;
+  const FlattenQuery* queries;
+  int num_queries;
+} FlattenBenchmarkData;
+
+void RunFlattenWorkloadIteration(void* data) {
+  const FlattenBenchmarkData* workload = (const FlattenBenchmarkData*) data;
+  for (int i = 0; i < workload->num_queries; i++) {
+    FcPattern* query = FcPatternDuplicate(workload->queries[i].query);
+    FcPattern* match = MatchFontconfigQuery(workload->config, query);
+    FcPatternDestroy(match);
+    FcPatternDestroy(query);
+  }
+}
+
+// Reads font descriptions from the workload file at |path|, or uses the
+// default workload if it's NULL, plus |extra_desc| if it's non-NULL. Blank
+// lines and lines starting with '#' are skipped. Returns the queries, with
+// their count in |num_queries|, or NULL on failure.
+FlattenQuery* ReadFlattenWorkload(const char* path,
+                                  const char* extra_desc,
+                                  int* num_queries) {
+  FILE* file = NULL;
+  if (path && !(file = fopen(path, "r"))) {
+    perror(path);
+    return NULL;
+  }
+  const int num_defaults = path ? 0 :
+      sizeof(kDefaultFlattenWorkload) / sizeof(*kDefaultFlattenWorkload);
+  int capacity = 64;
+  FlattenQuery* queries = malloc(capacity * sizeof(FlattenQuery));
+  assert(queries);
+  *num_queries = 0;
+  char line[4096];
+  for (int i = 0;; i++) {
+    const char* desc = NULL;
+    if (file && fgets(line, sizeof(line), file)) {
+      desc = line;
+    } else if (i < num_defaults) {
+      desc = kDefaultFlattenWorkload[i];
+    } else if (extra_desc) {
+      desc = extra_desc;
+      extra_desc = NULL;
+    } else {
+      break;
+    }
+    desc += strspn(desc, " \t");
+    const int len = strcspn(desc, "\r\n");
+    if (len == 0 || desc[0] == '#')
+      continue;
+
+    FontQuery query;
+    if (!ParseFontQuery(desc, &query)) {
+      fprintf(stderr, "Invalid font description \"%.*s\"\n", len, desc);
+      continue;
+    }
+    if (*num_queries == capacity) {
+      capacity *= 2;
+      queries = realloc(queries, capacity * sizeof(FlattenQuery));
+      assert(queries);
+    }
+    FlattenQuery* flatten_query = &queries[(*num_queries)++];
+    memset(flatten_query, 0, sizeof(*flatten_query));
+    snprintf(flatten_query->desc, sizeof(flatten_query->desc), "%.*s", len,
+             desc);
+    flatten_query->query = FcPatternCreate();
+    assert(flatten_query->query);
+    AddFontQueryToPattern(&query, flatten_query->query);
+  }
+  if (file)
+    fclose(file);
+  return queries;
+}
+
+// Size of the buffer that the flattened config is formatted into.
+#define FLATTEN_CONFIG_SIZE (16 * 1024 * 1024)
+
+// Writes a single config file to |path| that reproduces the current config's
+// font dirs and rejected fonts, its substitutions for the queries in the
+// workload file |workload_path| (or the default workload, plus |extra_desc|),
+// and the rendering settings of their matches. The flattened config is then
+// verified by matching the workload against both configs, and loading each
+// config and matching the workload with it are benchmarked. Returns false if
+// the config couldn't be written or doesn't match the same fonts.
+int FlattenConfig(const BenchmarkOptions* options,
+                  const char* path,
+                  const char* workload_path,
+                  const char* extra_desc) {
+  int num_queries = 0;
+  FlattenQuery* queries =
+      ReadFlattenWorkload(workload_path, extra_desc, &num_queries);
+  FcConfig* config = LoadFontconfigConfig(NULL);
+  if (!queries || !config) {
+    fprintf(stderr, "Failed to load the workload or config\n");
+    return 0;
+  }
+  int num_families = 0;
+  const FcChar8** families = GetInstalledFamilies(config, &num_families);
+  FcConfig* empty_config = FcConfigCreate();
+  assert(empty_config);
+  for (int i = 0; i < num_queries; i++) {
+    queries[i].defaults = FcPatternDuplicate(queries[i].query);
+    queries[i].substituted = FcPatternDuplicate(queries[i].query);
+    assert(queries[i].defaults && queries[i].substituted);
+    FcDefaultSubstitute(queries[i].defaults);
+    queries[i].match = MatchFontconfigQuery(config, queries[i].substituted);
+    FcPattern* font = FindConfigFont(config, queries[i].match);
+    queries[i].unprepared = font ?
+        FcFontRenderPrepare(empty_config, queries[i].substituted, font) :
+        FcPatternDuplicate(queries[i].match);
+    assert(queries[i].unprepared);
+  }
+  FcConfigDestroy(empty_config);
+
+  int num_files = 0, num_rules = 0;
+  FcStrList* files = FcConfigGetConfigFiles(config);
+  FcChar8* file = NULL;
+  while ((file = FcStrListNext(files))) {
+    num_files++;
+    num_rules += CountConfigFileRules((const char*) file);
+  }
+  FcStrListDone(files);
+
+  OutputArena arena = { malloc(FLATTEN_CONFIG_SIZE), FLATTEN_CONFIG_SIZE, 0 };
+  assert(arena.data);
+  ArenaPrintf(&arena,
+              "<?xml version=\"1.0\"?>\n"
+              "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+              "<!-- Flattened by font-config-info from %d config file(s) for a "
+              "workload of %d queries. -->\n"
+              "<fontconfig>\n", num_files, num_queries);
+  const int num_skipped_dirs = AppendFlattenedFontDirs(&arena, config);
+  const int num_pattern_rules = AppendFlattenedPatternRules(
+      &arena, config, queries, num_queries, families, num_families);
+  const int num_font_rules =
+      AppendFlattenedFontRules(&arena, queries, num_queries);
+  int ok = num_skipped_dirs >= 0 && num_pattern_rules >= 0 &&
+      num_font_rules >= 0 && ArenaPrintf(&arena, "</fontconfig>\n");
+  if (!ok)
+    fprintf(stderr, "Flattened config is too large\n");
+
+  FILE* output = ok ? fopen(path, "w") : NULL;
+  if (ok && (!output || fwrite(arena.data, 1, arena.used, output) !=
+             arena.used)) {
+    perror(path);
+    ok = 0;
+  }
+  if (output && fclose(output) != 0) {
+    perror(path);
+    ok = 0;
+  }
+  free(arena.data);
+
+  FcConfig* flattened = ok ? LoadFontconfigConfig(path) : NULL;
+  if (ok && !flattened) {
+    fprintf(stderr, "Failed to load %s\n", path);
+    ok = 0;
+  }
+  int num_verified = 0;
+  for (int i = 0; flattened && i < num_queries; i++) {
+    char expected[4096], actual[4096];
+    FormatFlattenResult(queries[i].desc, queries[i].match, expected,
+                        sizeof(expected));
+    FcPattern* query = FcPatternDuplicate(queries[i].query);
+    FcPattern* match = MatchFontconfigQuery(flattened, query);
+    FormatFlattenResult(queries[i].desc, match, actual, sizeof(actual));
+    if (strcmp(expected, actual) == 0) {
+      num_verified++;
+    } else {
+      const char* kObjects[] = { FC_FAMILY, FC_STYLE, FC_FILE, FC_INDEX,
+                                 FC_PIXEL_SIZE };
+      printf(NAME_FORMAT "%s:", "mismatch", queries[i].desc);
+      for (size_t j = 0; j < sizeof(kObjects) / sizeof(*kObjects); j++) {
+        if (!HaveSameValues(queries[i].match, match, kObjects[j]))
+          printf(" %s", kObjects[j]);
+      }
+      for (int j = 0; j < NUM_RENDERING_OBJECTS; j++) {
+        if (!HaveSameValues(queries[i].match, match, kRenderingObjects[j]))
+          printf(" %s", kRenderingObjects[j]);
+      }
+      for (int j = 0; j < NUM_FONT_PROPERTY_OBJECTS; j++) {
+        if (!HaveSameValues(queries[i].match, match, kFontPropertyObjects[j]))
+          printf(" %s", kFontPropertyObjects[j]);
+      }
+      printf("\n");
+    }
+    FcPatternDestroy(match);
+    FcPatternDestroy(query);
+  }
+
+  if (flattened) {
+    printf("Flattened config (%s):\n", path);
+    printf(NAME_FORMAT "%d -> 1\n", "config files", num_files);
+    printf(NAME_FORMAT "%d -> %d\n", "rules", num_rules,
+           num_pattern_rules + num_font_rules);
+    printf(NAME_FORMAT "%d\n", "dirs left out", num_skipped_dirs);
+    printf(NAME_FORMAT "%d of %d\n", "verified queries", num_verified,
+           num_queries);
+    fflush(stdout);
+
+    ScalingBenchmarkData original_init = { NULL, NULL, NULL };
+    ScalingBenchmarkData flattened_init = { path, NULL, NULL };
+    FlattenBenchmarkData original_workload = { config, queries, num_queries };
+    FlattenBenchmarkData flattened_workload = {
+      flattened, queries, num_queries
+    };
+    const struct {
+      const char* name;
+      const char* metric;
+      BenchmarkFunc func;
+      void* original;
+      void* flattened;
+    } kBenchmarks[] = {
+      { "init", "flatten-init", RunScalingInitIteration, &original_init,
+        &flattened_init },
+      { "workload match", "flatten-workload", RunFlattenWorkloadIteration,
+        &original_workload, &flattened_workload },
+    };
+    for (size_t i = 0; i < sizeof(kBenchmarks) / sizeof(*kBenchmarks); i++) {
+      char metric[64], original_str[32], flattened_str[32];
+      BenchmarkResult original_result, flattened_result;
+      snprintf(metric, sizeof(metric), "%s-original", kBenchmarks[i].metric);
+      free(RunBenchmark(options, metric, kBenchmarks[i].func,
+                        kBenchmarks[i].original, &original_result));
+      snprintf(metric, sizeof(metric), "%s-flattened", kBenchmarks[i].metric);
+      free(RunBenchmark(options, metric, kBenchmarks[i].func,
+                        kBenchmarks[i].flattened, &flattened_result));
+      FormatDuration(original_result.median, original_str,
+                     sizeof(original_str));
+      FormatDuration(flattened_result.median, flattened_str,
+                     sizeof(flattened_str));
+      printf(NAME_FORMAT "%s -> %s\n", kBenchmarks[i].name, original_str,
+             flattened_str);
+    }
+    printf("\n");
+    FcConfigDestroy(flattened);
+  }
+
+  for (int i = 0; i < num_queries; i++) {
+    FcPatternDestroy(queries[i].query);
+    FcPatternDestroy(queries[i].defaults);
+    FcPatternDestroy(queries[i].substituted);
+    FcPatternDestroy(queries[i].match);
+    FcPatternDestroy(queries[i].unprepared);
+    free(queries[i].pattern_edits);
+    free(queries[i].font_edits);
+  }
+  free(queries);
+  free(families);
+  FcConfigDestroy(config);
+  return ok && num_verified == num_queries;
+}
+
+// Generic families matched for every language by the --prune-dirs locale
+// sweep.
+const char* kLocaleSweepFamilies[] = {
+  "sans-serif", "serif", "monospace", "emoji",
+};
+
+// Returns the total size of the caches for |dir| and its subdirs, and adds the
+// number of fonts in them to |num_fonts|.
+long long GetFontDirCacheSize(FcConfig* config,
+                              const FcChar8* dir,
+                              int* num_fonts) {
+  FcChar8* cache_file = NULL;
+  FcCache* cache = FcDirCacheLoad(dir, config, &cache_file);
+  long long size = 0;
+  if (cache_file) {
+    size = GetFileSize((const char*) cache_file);
+    FcStrFree(cache_file);
+  }
+  if (!cache)
+    return size > 0 ? size : 0;
+  FcFontSet* fonts = FcCacheCopySet(cache);
+  if (fonts) {
+    *num_fonts += fonts->nfont;
+    FcFontSetDestroy(fonts);
+  }
+  for (int i = 0; i < FcCacheNumSubdir(cache); i++)
+    size += GetFontDirCacheSize(config, FcCacheSubdir(cache, i), num_fonts);
+  FcDirCacheUnload(cache);
+  return size;
+}
+
+// Returns the total size of the caches for |config|'s font dirs.
+long long GetConfigCacheSize(FcConfig* config) {
+  int num_dirs = 0, num_fonts = 0;
+  char** dirs = GetTopLevelFontDirs(config, &num_dirs);
+  long long size = 0;
+  for (int i = 0; i < num_dirs; i++) {
+    size += GetFontDirCacheSize(config, (const FcChar8*) dirs[i], &num_fonts);
+    free(dirs[i]);
+  }
+  free(dirs);
+  return size;
+}
+
+// Matches each of |queries| and, for every language that Fontconfig has
+// orthographies for, each of kLocaleSweepFamilies against |config|. Returns a
+// new array of the matches' "FILE:INDEX" keys, in the same order for any
+// config, and stores its length in |num_matches|.
+char** RunFontSweep(FcConfig* config,
+                    const FlattenQuery* queries,
+                    int num_queries,
+                    int* num_matches) {
+  FcStrSet* langs = FcGetLangs();
+  FcStrList* lang_list = FcStrListCreate(langs);
+  int num_langs = 0;
+  while (FcStrListNext(lang_list))
+    num_langs++;
+  FcStrListFirst(lang_list);
+
+  const int num_families =
+      sizeof(kLocaleSweepFamilies) / sizeof(*kLocaleSweepFamilies);
+  char** matches = calloc(num_queries + num_langs * num_families + 1,
+                          sizeof(char*));
+  assert(matches);
+  *num_matches = 0;
+  const FcChar8* lang = NULL;
+  for (int i = 0; i < num_queries + num_langs * num_families; i++) {
+    FcPattern* query = NULL;
+    if (i < num_queries) {
+      query = FcPatternDuplicate(queries[i].query);
+    } else {
+      const int family = (i - num_queries) % num_families;
+      if (family == 0)
+        lang = FcStrListNext(lang_list);
+      query = FcPatternCreate();
+      assert(query);
+      FcPatternAddString(query, FC_FAMILY,
+                         (const FcChar8*) kLocaleSweepFamilies[family]);
+      FcPatternAddString(query, FC_LANG, lang);
+    }
+    assert(query);
+    FcPattern* match = MatchFontconfigQuery(config, query);
+    FcChar8* file = NULL;
+    int index = 0;
+    FcPatternGetString(match, FC_FILE, 0, &file);
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    if (asprintf(&matches[*num_matches], "%s:%d",
+                 file ? (const char*) file : "", index) < 0)
+      matches[*num_matches] = NULL;
+    assert(matches[*num_matches]);
+    (*num_matches)++;
+    FcPatternDestroy(match);
+    FcPatternDestroy(query);
+  }
+  FcStrListDone(lang_list);
+  FcStrSetDestroy(langs);
+  return matches;
+}
+
+void FreeStrings(char** strs, int num_strs) {
+  for (int i = 0; i < num_strs; i++)
+    free(strs[i]);
+  free(strs);
+}
+
+// Finds which of the current config's font dirs hold fonts that the default
+// workload (or the queries in |workload_path|, plus |extra_desc|) and a locale
+// sweep of the generic families resolve to, and writes a config to |path|
+// that includes the current one but only keeps those dirs. The pruned config
+// is checked to resolve the sweep to the same fonts, and loading each config
+// is benchmarked and their cache sizes compared. Returns false on failure.
+int PruneFontDirs(const BenchmarkOptions* options,
+                  const char* path,
+                  const char* workload_path,
+                  const char* extra_desc) {
+  int num_queries = 0;
+  FlattenQuery* queries =
+      ReadFlattenWorkload(workload_path, extra_desc, &num_queries);
+  FcConfig* config = LoadFontconfigConfig(NULL);
+  FcChar8* config_path = FcConfigFilename(NULL);
+  if (!queries || !config || !config_path) {
+    fprintf(stderr, "Failed to load the workload or config\n");
+    return 0;
+  }
+
+  int num_matches = 0, num_dirs = 0, num_kept = 0;
+  char** matches = RunFontSweep(config, queries, num_queries, &num_matches);
+  char** dirs = GetTopLevelFontDirs(config, &num_dirs);
+  int* kept = calloc(num_dirs + 1, sizeof(int));
+  assert(kept);
+
+  printf("Font dirs (%d sweep matches):\n", num_matches);
+  printf("%-40s %-8s %-12s %-8s %s\n", "dir", "fonts", "cache", "matches",
+         "action");
+  for (int i = 0; i < num_dirs; i++) {
+    int num_fonts = 0, num_dir_matches = 0;
+    const long long cache_size =
+        GetFontDirCacheSize(config, (const FcChar8*) dirs[i], &num_fonts);
+    for (int j = 0; j < num_matches; j++)
+      num_dir_matches += IsSubdirectory(matches[j], dirs[i]);
+    kept[i] = num_dir_matches > 0;
+    num_kept += kept[i];
+    char cache_str[32];
+    snprintf(cache_str, sizeof(cache_str), "%.1f KiB", cache_size / 1024.0);
+    printf("%-40s %-8d %-12s %-8d %s\n", dirs[i], num_fonts, cache_str,
+           num_dir_matches, kept[i] ? "keep" : "drop");
+  }
+  printf("\n");
+
+  // Dropped dirs are left in as comments unless they can't be.
+  OutputArena arena = { malloc(FLATTEN_BUFFER_SIZE), FLATTEN_BUFFER_SIZE, 0 };
+  assert(arena.data);
+  int ok = ArenaPrintf(&arena,
+                       "<?xml version=\"1.0\"?>\n"
+                       "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+                       "<fontconfig>\n"
+                       "  <include>") &&
+      AppendXmlText(&arena, (const char*) config_path) &&
+      ArenaPrintf(&arena, "</include>\n  <reset-dirs/>\n");
+  for (int i = 0; ok && i < num_dirs; i++) {
+    if (!kept[i] && strstr(dirs[i], "--"))
+      continue;
+    ok = ArenaPrintf(&arena, kept[i] ? "  <dir>" : "  <!-- <dir>") &&
+        AppendXmlText(&arena, dirs[i]) &&
+        ArenaPrintf(&arena, kept[i] ? "</dir>\n" : "</dir> -->\n");
+  }
+  ok = ok && ArenaPrintf(&arena, "</fontconfig>\n");
+  FILE* file = ok ? fopen(path, "w") : NULL;
+  if (file && fwrite(arena.data, 1, arena.used, file) != arena.used) {
+    fclose(file);
+    file = NULL;
+  } else if (file && fclose(file) != 0) {
+    file = NULL;
+  }
+  if (!file)
+    perror(path);
+  free(arena.data);
+
+  FcConfig* pruned = file ? LoadFontconfigConfig(path) : NULL;
+  int num_unchanged = 0;
+  if (file && !pruned)
+    fprintf(stderr, "Failed to load %s\n", path);
+  if (pruned) {
+    int num_pruned_matches = 0;
+    char** pruned_matches =
+        RunFontSweep(pruned, queries, num_queries, &num_pruned_matches);
+    for (int i = 0; i < num_matches && i < num_pruned_matches; i++)
+      num_unchanged += strcmp(matches[i], pruned_matches[i]) == 0;
+    FreeStrings(pruned_matches, num_pruned_matches);
+
+    printf("Pruned config (%s):\n", path);
+    printf(NAME_FORMAT "%d -> %d\n", "dirs", num_dirs, num_kept);
+    printf(NAME_FORMAT "%.1f KiB -> %.1f KiB\n", "cache size",
+           GetConfigCacheSize(config) / 1024.0,
+           GetConfigCacheSize(pruned) / 1024.0);
+    printf(NAME_FORMAT "%d of %d\n", "unchanged matches", num_unchanged,
+           num_matches);
+    fflush(stdout);
+
+    ScalingBenchmarkData original_init = { NULL, NULL, NULL };
+    ScalingBenchmarkData pruned_init = { path, NULL, NULL };
+    BenchmarkResult original_result, pruned_result;
+    free(RunBenchmark(options, "prune-init-original", RunScalingInitIteration,
+                      &original_init, &original_result));
+    free(RunBenchmark(options, "prune-init-pruned", RunScalingInitIteration,
+                      &pruned_init, &pruned_result));
+    char original_str[32], pruned_str[32];
+    FormatDuration(original_result.median, original_str, sizeof(original_str));
+    FormatDuration(pruned_result.median, pruned_str, sizeof(pruned_str));
+    printf(NAME_FORMAT "%s -> %s\n", "init", original_str, pruned_str);
+    printf("\n");
+    FcConfigDestroy(pruned);
+  }
+
+  for (int i = 0; i < num_queries; i++)
+    FcPatternDestroy(queries[i].query);
+  free(queries);
+  free(kept);
+  FreeStrings(dirs, num_dirs);
+  FreeStrings(matches, num_matches);
+  FcStrFree(config_path);
+  FcConfigDestroy(config);
+  return pruned && num_unchanged == num_matches;
+}
+
+// Maximum number of glyphs sampled from each face by --outline-stats. Glyphs
+// are spread evenly across each face's glyph IDs.
+#define OUTLINE_MAX_GLYPHS 512
+
+// Pixel size at which --outline-stats rasterizes glyphs.
+#define OUTLINE_PIXEL_SIZE 16
+
+// Number of times that each glyph is rasterized. The fastest is kept, since
+// slower runs mostly measure interruptions.
+#define OUTLINE_RENDER_REPS 3
+
+// Called by RunFaceSweep() for the |index|th face with a FreeType library owned
+// by the calling thread.
+typedef void (*FaceSweepFunc)(FT_Library library, int index, void* data);
+
+// Faces shared by RunFaceSweep()'s worker threads, which claim them in order.
+typedef struct {
+  const BenchmarkOptions* options;
+  int num_faces;
+  FaceSweepFunc func;
+  void* data;
+  int next_face;
+  int next_thread;
+} FaceSweepWork;
+
+void* RunFaceSweepThread(void* data) {
+  FaceSweepWork* work = (FaceSweepWork*) data;
+  PinCurrentThread(work->options,
+                   __atomic_fetch_add(&work->next_thread, 1, __ATOMIC_RELAXED));
+  ProfilerRegisterThread();
+  FT_Library library;
+  if (FT_Init_FreeType(&library) != 0)
+    return NULL;
+  for (;;) {
+    const int i = __atomic_fetch_add(&work->next_face, 1, __ATOMIC_RELAXED);
+    if (i >= work->num_faces)
+      break;
+    work->func(library, i, work->data);
+  }
+  FT_Done_FreeType(library);
+  return NULL;
+}
+
+// Calls |func| for each of |num_faces| faces, spread across one thread per CPU
+// in |options| (or per online CPU if none were chosen). Returns the number of
+// threads used.
+long RunFaceSweep(const BenchmarkOptions* options,
+                  int num_faces,
+                  FaceSweepFunc func,
+                  void* data) {
+  FaceSweepWork work = { options, num_faces, func, data, 0, 0 };
+  long num_threads = options->num_cpus > 0 ? options->num_cpus :
+      sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > num_faces)
+    num_threads = num_faces;
+  if (num_threads < 1)
+    num_threads = 1;
+  pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+  assert(threads);
+  long num_started = 0;
+  for (; num_started < num_threads; num_started++) {
+    if (pthread_create(&threads[num_started], NULL, RunFaceSweepThread,
+                       &work) != 0)
+      break;
+  }
+  // The calling thread picks up the faces if no threads could be started.
+  if (num_started == 0)
+    RunFaceSweepThread(&work);
+  for (long i = 0; i < num_started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  return num_started > 0 ? num_started : 1;
+}
+
+// Returns the CPU time consumed by the calling thread in nanoseconds.
+double GetThreadTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Per-glyph metrics collected by --outline-stats.
+enum {
+  OUTLINE_POINTS,
+  OUTLINE_CONTOURS,
+  OUTLINE_SEGMENTS,
+  OUTLINE_CURVES,
+  OUTLINE_BBOX,
+  OUTLINE_RASTER,
+  NUM_OUTLINE_METRICS,
+};
+
+const char* const kOutlineMetricNames[NUM_OUTLINE_METRICS] = {
+  "points", "contours", "segments", "curves", "bbox", "raster",
+};
+
+// Outline metrics of the sampled glyphs of a single face. The bbox is the
+// glyph's bounding box area as a fraction of the em square, and raster is the
+// thread CPU time in nanoseconds to load and render the glyph.
+typedef struct {
+  const char* file;
+  int index;
+  long num_glyphs;
+  int num_sampled;
+  double* values[NUM_OUTLINE_METRICS];
+} OutlineFaceStats;
+
+int CountOutlineMove(const FT_Vector* to, void* user) {
+  return 0;
+}
+
+int CountOutlineLine(const FT_Vector* to, void* user) {
+  ((int*) user)[0]++;
+  return 0;
+}
+
+int CountOutlineConic(const FT_Vector* control,
+                      const FT_Vector* to,
+                      void* user) {
+  ((int*) user)[1]++;
+  return 0;
+}
+
+int CountOutlineCubic(const FT_Vector* control1,
+                      const FT_Vector* control2,
+                      const FT_Vector* to,
+                      void* user) {
+  ((int*) user)[1]++;
+  return 0;
+}
+
+// Samples glyphs from the |index|th face in the OutlineFaceStats array |data|
+// using |library| and fills in their metrics. Glyphs without an outline (e.g.
+// spaces and bitmaps) are skipped. Leaves the face's stats empty if it can't be
+// loaded or isn't scalable.
+void MeasureFaceOutlines(FT_Library library, int index, void* data) {
+  OutlineFaceStats* stats = &((OutlineFaceStats*) data)[index];
+  FT_Face face = NULL;
+  if (FT_New_Face(library, stats->file, stats->index, &face) != 0)
+    return;
+  if (!FT_IS_SCALABLE(face) || face->num_glyphs <= 0 ||
+      FT_Set_Pixel_Sizes(face, 0, OUTLINE_PIXEL_SIZE) != 0) {
+    FT_Done_Face(face);
+    return;
+  }
+  stats->num_glyphs = face->num_glyphs;
+  const int num_samples = stats->num_glyphs < OUTLINE_MAX_GLYPHS ?
+      stats->num_glyphs : OUTLINE_MAX_GLYPHS;
+  for (int i = 0; i < NUM_OUTLINE_METRICS; i++) {
+    stats->values[i] = malloc(num_samples * sizeof(double));
+    assert(stats->values[i]);
+  }
+
+  const FT_Outline_Funcs kFuncs = {
+    CountOutlineMove, CountOutlineLine, CountOutlineConic, CountOutlineCubic,
+    0, 0,
+  };
+  const double em_area = (double) face->units_per_EM * face->units_per_EM;
+  for (int i = 0; i < num_samples; i++) {
+    const FT_UInt glyph =
+        (FT_UInt) ((long) i * stats->num_glyphs / num_samples);
+    if (FT_Load_Glyph(face, glyph, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING |
+                      FT_LOAD_NO_BITMAP) != 0 ||
+        face->glyph->format != FT_GLYPH_FORMAT_OUTLINE ||
+        face->glyph->outline.n_points == 0)
+      continue;
+    FT_Outline* outline = &face->glyph->outline;
+    int segments[2] = { 0, 0 };  // Lines and curves.
+    FT_BBox bbox;
+    if (FT_Outline_Decompose(outline, &kFuncs, segments) != 0 ||
+        FT_Outline_Get_BBox(outline, &bbox) != 0)
+      continue;
+    double* values[NUM_OUTLINE_METRICS];
+    for (int j = 0; j < NUM_OUTLINE_METRICS; j++)
+      values[j] = &stats->values[j][stats->num_sampled];
+    *values[OUTLINE_POINTS] = outline->n_points;
+    *values[OUTLINE_CONTOURS] = outline->n_contours;
+    *values[OUTLINE_SEGMENTS] = segments[0] + segments[1];
+    *values[OUTLINE_CURVES] = segments[1];
+    *values[OUTLINE_BBOX] = em_area > 0 ?
+        (double) (bbox.xMax - bbox.xMin) * (bbox.yMax - bbox.yMin) / em_area :
+        0.0;
+
+    double best = -1.0;
+    for (int rep = 0; rep < OUTLINE_RENDER_REPS; rep++) {
+      const double start = GetThreadTimeNs();
+      const FT_Error error =
+          FT_Load_Glyph(face, glyph, FT_LOAD_RENDER | FT_LOAD_NO_BITMAP);
+      const double elapsed = GetThreadTimeNs() - start;
+      if (error != 0)
+        break;
+      if (best < 0 || elapsed < best)
+        best = elapsed;
+    }
+    if (best < 0)
+      continue;
+    *values[OUTLINE_RASTER] = best;
+    stats->num_sampled++;
+  }
+  FT_Done_Face(face);
+}
+
+// Returns the mean of the |n| values in |values|.
+double GetMean(const double* values, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++)
+    sum += values[i];
+  return n > 0 ? sum / n : 0.0;
+}
+
+// Fits y = |intercept| + |slope| * x to the |n| points in |x| and |y| by least
+// squares. Returns Pearson's correlation coefficient, or 0 if either variable
+// is constant.
+double FitLine(const double* x,
+               const double* y,
+               int n,
+               double* intercept,
+               double* slope) {
+  const double mean_x = GetMean(x, n), mean_y = GetMean(y, n);
+  double sxx = 0.0, syy = 0.0, sxy = 0.0;
+  for (int i = 0; i < n; i++) {
+    sxx += (x[i] - mean_x) * (x[i] - mean_x);
+    syy += (y[i] - mean_y) * (y[i] - mean_y);
+    sxy += (x[i] - mean_x) * (y[i] - mean_y);
+  }
+  *slope = sxx > 0 ? sxy / sxx : 0.0;
+  *intercept = mean_y - *slope * mean_x;
+  return sxx > 0 && syy > 0 ? sxy / sqrt(sxx * syy) : 0.0;
+}
+
+// Measures the outline complexity of glyphs sampled from every installed
+// scalable face, with faces spread across threads by RunFaceSweep(), and
+// prints per-face distributions. The time to rasterize each glyph is measured
+// alongside, and each metric's correlation with it is printed along with a
+// linear fit that predicts it.
+void RunOutlineStats(const BenchmarkOptions* options) {
+  FcFontSet* fonts = FcConfigGetFonts(NULL, FcSetSystem);
+  OutlineFaceStats* faces =
+      calloc(fonts ? fonts->nfont + 1 : 1, sizeof(OutlineFaceStats));
+  assert(faces);
+  int num_faces = 0;
+  for (int i = 0; fonts && i < fonts->nfont; i++) {
+    FcChar8* file = NULL;
+    FcBool outline = FcFalse;
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &file) !=
+        FcResultMatch ||
+        FcPatternGetBool(fonts->fonts[i], FC_OUTLINE, 0, &outline) !=
+        FcResultMatch || !outline)
+      continue;
+    OutlineFaceStats* stats = &faces[num_faces++];
+    stats->file = (const char*) file;
+    FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &stats->index);
+  }
+
+  const double start = GetTimeNs();
+  const long num_threads =
+      RunFaceSweep(options, num_faces, MeasureFaceOutlines, faces);
+  const double elapsed = GetTimeNs() - start;
+
+  int total_sampled = 0;
+  for (int i = 0; i < num_faces; i++)
+    total_sampled += faces[i].num_sampled;
+  char elapsed_str[32];
+  FormatDuration(elapsed, elapsed_str, sizeof(elapsed_str));
+  printf("Outline stats (%d faces, %d glyphs, %ld threads, %s):\n",
+         num_faces, total_sampled, num_threads, elapsed_str);
+  printf("%-32s %-10s %-12s %-10s %-12s %-12s %s\n", "face", "glyphs",
+         "points", "contours", "segments", "bbox", "raster");
+
+  // Per-glyph values from all faces are pooled for the correlations.
+  double* pooled[NUM_OUTLINE_METRICS];
+  for (int j = 0; j < NUM_OUTLINE_METRICS; j++) {
+    pooled[j] = malloc((total_sampled + 1) * sizeof(double));
+    assert(pooled[j]);
+  }
+  int num_pooled = 0;
+  for (int i = 0; i < num_faces; i++) {
+    OutlineFaceStats* stats = &faces[i];
+    const char* slash = strrchr(stats->file, '/');
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s:%d", slash ? slash + 1 : stats->file,
+             stats->index);
+    if (stats->num_sampled == 0) {
+      printf("%-32s [no outline glyphs]\n", name);
+      continue;
+    }
+    const int n = stats->num_sampled;
+    double mean[NUM_OUTLINE_METRICS], p95[NUM_OUTLINE_METRICS];
+    for (int j = 0; j < NUM_OUTLINE_METRICS; j++) {
+      memcpy(&pooled[j][num_pooled], stats->values[j], n * sizeof(double));
+      mean[j] = GetMean(stats->values[j], n);
+      qsort(stats->values[j], n, sizeof(double), CompareDoubles);
+      p95[j] = GetQuantile(stats->values[j], n, 0.95);
+    }
+    num_pooled += n;
+
+    char glyphs_str[32], points_str[32], segments_str[32], bbox_str[32],
+        raster_str[32];
+    snprintf(glyphs_str, sizeof(glyphs_str), "%d/%ld", n, stats->num_glyphs);
+    snprintf(points_str, sizeof(points_str), "%.1f/%.0f",
+             mean[OUTLINE_POINTS], p95[OUTLINE_POINTS]);
+    snprintf(segments_str, sizeof(segments_str), "%.1f/%.0f",
+             mean[OUTLINE_SEGMENTS], p95[OUTLINE_SEGMENTS]);
+    snprintf(bbox_str, sizeof(bbox_str), "%.3f/%.3f", mean[OUTLINE_BBOX],
+             p95[OUTLINE_BBOX]);
+    FormatDuration(mean[OUTLINE_RASTER], raster_str, sizeof(raster_str));
+    printf("%-32s %-10s %-12s %-10.1f %-12s %-12s %s\n", name, glyphs_str,
+           points_str, mean[OUTLINE_CONTOURS], segments_str, bbox_str,
+           raster_str);
+  }
+  printf("(points, segments and bbox are mean/p95; bbox is a fraction of the "
+         "em square;\nraster is the mean time to render at %d px)\n\n",
+         OUTLINE_PIXEL_SIZE);
+
+  printf("Outline/raster correlation (%d glyphs):\n", num_pooled);
+  for (int j = 0; num_pooled > 1 && j < NUM_OUTLINE_METRICS; j++) {
+    if (j == OUTLINE_RASTER)
+      continue;
+    double intercept = 0.0, slope = 0.0;
+    const double r = FitLine(pooled[j], pooled[OUTLINE_RASTER], num_pooled,
+                             &intercept, &slope);
+    char intercept_str[32];
+    FormatDuration(intercept, intercept_str, sizeof(intercept_str));
+    printf(NAME_FORMAT "r=%+.3f R^2=%.3f raster ~ %s + %.4g ns * %s\n",
+           kOutlineMetricNames[j], r, r * r, intercept_str, slope,
+           kOutlineMetricNames[j]);
+  }
+  if (num_pooled <= 1)
+    printf("[too few glyphs]\n");
+  printf("\n");
+
+  for (int j = 0; j < NUM_OUTLINE_METRICS; j++)
+    free(pooled[j]);
+  for (int i = 0; i < num_faces; i++) {
+    for (int j = 0; j < NUM_OUTLINE_METRICS; j++)
+      free(faces[i].values[j]);
+  }
+  free(faces);
+}
+
+// Text shaped by --shaping-sweep, one sample per script, each named by its ISO
+// 15924 code. The samples exercise common layout features such as kerning,
+// ligatures, contextual forms, marks and conjuncts.
+const struct {
+  const char* script;
+  const char* text;
+} kShapingSamples[] = {
+  { "Latn", "Efficient office waffles: AVATAR, Tyrant, café naïve" },
+  { "Grek", "Ξεσκεπάζω την ψυχοφθόρα βδελυγμία" },
+  { "Cyrl", "Съешь же ещё этих мягких французских булок" },
+  { "Hebr", "דג סקרן שט בים מאוכזב ולפתע מצא חברה" },
+  { "Arab", "نص حكيم له سر قاطع وذو شأن عظيم" },
+  { "Deva", "ऋषियों को सताने वाले दुष्ट राक्षसों के राजा रावण" },
+  { "Thai", "เป็นมนุษย์สุดประเสริฐเลิศคุณค่า" },
+  { "Hani", "天地玄黄宇宙洪荒日月盈昃辰宿列张" },
+};
+
+#define NUM_SHAPING_SAMPLES \
+  ((int) (sizeof(kShapingSamples) / sizeof(*kShapingSamples)))
+
+// Number of times that each face shapes its samples. The first run is reported
+// separately since it includes loading the layout tables and building the
+// shape plans.
+#define SHAPING_REPS 16
+
+// Faces shaping a script's sample more than this many times slower per
+// character than the median of the faces covering that script are reported as
+// expensive.
+#define SHAPING_OUTLIER_FACTOR 4.0
+
+// Shaping cost of a single face. Arrays are indexed by sample, and times are
+// thread CPU time in nanoseconds to shape the sample.
+typedef struct {
+  const char* file;
+  int index;
+  int covered;  // Bitmask of the samples whose characters are all present.
+  int num_chars[NUM_SHAPING_SAMPLES];
+  int num_glyphs[NUM_SHAPING_SAMPLES];
+  unsigned int gsub_lookups;
+  unsigned int gpos_lookups;
+  double cold_ns[NUM_SHAPING_SAMPLES];
+  double warm_ns[NUM_SHAPING_SAMPLES];  // Median of the runs after the first.
+  int loaded;
+} ShapingFaceStats;
+
+// A face's shaping cost per character for one script's sample.
+typedef struct {
+  const ShapingFaceStats* stats;
+  double cost;
+} ShapingScriptCost;
+
+// Shapes the covered samples with the |index|th face in the ShapingFaceStats
+// array |data| and fills in its stats. HarfBuzz loads the font itself, as
+// Pango does, so |library| is unused.
+void ShapeFaceSamples(FT_Library library, int index, void* data) {
+  ShapingFaceStats* stats = &((ShapingFaceStats*) data)[index];
+  hb_blob_t* blob = hb_blob_create_from_file(stats->file);
+  hb_face_t* face = hb_face_create(blob, stats->index);
+  hb_font_t* font = hb_font_create(face);
+  hb_buffer_t* buffer = hb_buffer_create();
+  if (hb_blob_get_length(blob) > 0) {
+    double times[NUM_SHAPING_SAMPLES][SHAPING_REPS];
+    for (int rep = 0; rep < SHAPING_REPS; rep++) {
+      for (int i = 0; i < NUM_SHAPING_SAMPLES; i++) {
+        if (!(stats->covered & (1 << i)))
+          continue;
+        const double start = GetThreadTimeNs();
+        hb_buffer_clear_contents(buffer);
+        hb_buffer_add_utf8(buffer, kShapingSamples[i].text, -1, 0, -1);
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(font, buffer, NULL, 0);
+        times[i][rep] = GetThreadTimeNs() - start;
+        if (rep == 0)
+          stats->num_glyphs[i] = hb_buffer_get_length(buffer);
+      }
+    }
+    for (int i = 0; i < NUM_SHAPING_SAMPLES; i++) {
+      if (!(stats->covered & (1 << i)))
+        continue;
+      stats->cold_ns[i] = times[i][0];
+      qsort(times[i] + 1, SHAPING_REPS - 1, sizeof(double), CompareDoubles);
+      stats->warm_ns[i] = GetQuantile(times[i] + 1, SHAPING_REPS - 1, 0.5);
+    }
+
+    // Counted after shaping so that loading the tables is part of the cold
+    // run.
+    stats->gsub_lookups =
+        hb_ot_layout_table_get_lookup_count(face, HB_OT_TAG_GSUB);
+    stats->gpos_lookups =
+        hb_ot_layout_table_get_lookup_count(face, HB_OT_TAG_GPOS);
+    stats->loaded = 1;
+  }
+  hb_buffer_destroy(buffer);
+  hb_font_destroy(font);
+  hb_face_destroy(face);
+  hb_blob_destroy(blob);
+}
+
+// Sorts ShapingScriptCosts from most to least expensive.
+int CompareShapingCosts(const void* a, const void* b) {
+  const double cost_a = ((const ShapingScriptCost*) a)->cost;
+  const double cost_b = ((const ShapingScriptCost*) b)->cost;
+  return cost_a > cost_b ? -1 : (cost_a < cost_b ? 1 : 0);
+}
+
+// Returns whether |charset| contains all of the characters in the UTF-8 string
+// |text|, and adds the number of characters to |num_chars|.
+int HasAllChars(const FcCharSet* charset, const char* text, int* num_chars) {
+  const int len = strlen(text);
+  for (int i = 0; i < len;) {
+    FcChar32 ch = 0;
+    const int size = FcUtf8ToUcs4((const FcChar8*) text + i, &ch, len - i);
+    if (size <= 0 || !FcCharSetHasChar(charset, ch))
+      return 0;
+    i += size;
+    (*num_chars)++;
+  }
+  return 1;
+}
+
+// Shapes each script's sample with every installed face that covers it, with
+// faces spread across threads by RunFaceSweep(), and prints the faces covering
+// each script ranked by shaping time per character along with their GSUB and
+// GPOS lookup counts. Faces that are far slower than the median for a script
+// are counted as expensive, since complex scripts are inherently slower to
+// shape than simple ones.
+void RunShapingSweep(const BenchmarkOptions* options) {
+  FcFontSet* fonts = FcConfigGetFonts(NULL, FcSetSystem);
+  ShapingFaceStats* faces =
+      calloc(fonts ? fonts->nfont + 1 : 1, sizeof(ShapingFaceStats));
+  assert(faces);
+  int num_faces = 0;
+  for (int i = 0; fonts && i < fonts->nfont; i++) {
+    ShapingFaceStats* stats = &faces[num_faces];
+    FcChar8* file = NULL;
+    FcCharSet* charset = NULL;
+    FcBool outline = FcFalse;
+    if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &file) !=
+        FcResultMatch ||
+        FcPatternGetCharSet(fonts->fonts[i], FC_CHARSET, 0, &charset) !=
+        FcResultMatch ||
+        FcPatternGetBool(fonts->fonts[i], FC_OUTLINE, 0, &outline) !=
+        FcResultMatch || !outline)
+      continue;
+    for (int j = 0; j < NUM_SHAPING_SAMPLES; j++) {
+      int num_chars = 0;
+      if (HasAllChars(charset, kShapingSamples[j].text, &num_chars)) {
+        stats->covered |= 1 << j;
+        stats->num_chars[j] = num_chars;
+      }
+    }
+    if (!stats->covered) {
+      memset(stats, 0, sizeof(*stats));
+      continue;
+    }
+    stats->file = (const char*) file;
+    FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &stats->index);
+    num_faces++;
+  }
+
+  const double start = GetTimeNs();
+  const long num_threads =
+      RunFaceSweep(options, num_faces, ShapeFaceSamples, faces);
+  const double elapsed = GetTimeNs() - start;
+
+  char elapsed_str[32];
+  FormatDuration(elapsed, elapsed_str, sizeof(elapsed_str));
+  printf("Shaping cost (%d of %d faces cover a sample, %ld threads, %s):\n",
+         num_faces, fonts ? fonts->nfont : 0, num_threads, elapsed_str);
+
+  ShapingScriptCost* costs =
+      malloc((num_faces + 1) * sizeof(ShapingScriptCost));
+  double* sorted_costs = malloc((num_faces + 1) * sizeof(double));
+  int* expensive_faces = calloc(num_faces + 1, sizeof(int));
+  assert(costs && sorted_costs && expensive_faces);
+  for (int j = 0; j < NUM_SHAPING_SAMPLES; j++) {
+    int num_covering = 0, num_loaded = 0;
+    for (int i = 0; i < num_faces; i++) {
+      const ShapingFaceStats* stats = &faces[i];
+      if (!(stats->covered & (1 << j)))
+        continue;
+      costs[num_covering].stats = stats;
+      costs[num_covering].cost = stats->loaded ?
+          stats->warm_ns[j] / stats->num_chars[j] : 0.0;
+      if (stats->loaded)
+        sorted_costs[num_loaded++] = costs[num_covering].cost;
+      num_covering++;
+    }
+    if (num_covering == 0)
+      continue;
+    qsort(costs, num_covering, sizeof(ShapingScriptCost), CompareShapingCosts);
+    qsort(sorted_costs, num_loaded, sizeof(double), CompareDoubles);
+    const double median = num_loaded > 0 ?
+        GetQuantile(sorted_costs, num_loaded, 0.5) : 0.0;
+
+    char median_str[32];
+    FormatDuration(median, median_str, sizeof(median_str));
+    printf("%s (%d faces, median %s per char):\n", kShapingSamples[j].script,
+           num_covering, median_str);
+    printf("  %-32s %-10s %-8s %-12s %-12s %s\n", "face", "GSUB/GPOS",
+           "glyphs", "cold", "warm", "per char");
+    for (int i = 0; i < num_covering; i++) {
+      const ShapingFaceStats* stats = costs[i].stats;
+      const char* slash = strrchr(stats->file, '/');
+      char name[PATH_MAX];
+      snprintf(name, sizeof(name), "%s:%d", slash ? slash + 1 : stats->file,
+               stats->index);
+      if (!stats->loaded) {
+        printf("  %-32s [failed to load]\n", name);
+        continue;
+      }
+      const int expensive = costs[i].cost > SHAPING_OUTLIER_FACTOR * median;
+      if (expensive)
+        expensive_faces[stats - faces] = 1;
+
+      char lookups_str[32], cold_str[32], warm_str[32], cost_str[32];
+      snprintf(lookups_str, sizeof(lookups_str), "%u/%u",
+               stats->gsub_lookups, stats->gpos_lookups);
+      FormatDuration(stats->cold_ns[j], cold_str, sizeof(cold_str));
+      FormatDuration(stats->warm_ns[j], warm_str, sizeof(warm_str));
+      FormatDuration(costs[i].cost, cost_str, sizeof(cost_str));
+      printf("  %-32s %-10s %-8d %-12s %-12s %s%s\n", name, lookups_str,
+             stats->num_glyphs[j], cold_str, warm_str, cost_str,
+             expensive ? " [expensive]" : "");
+    }
+  }
+
+  int num_expensive = 0;
+  for (int i = 0; i < num_faces; i++)
+    num_expensive += expensive_faces[i];
+  printf("(cold is the first run and warm the median of the next %d;\n"
+         "per char is warm divided by the characters shaped)\n",
+         SHAPING_REPS - 1);
+  printf(NAME_FORMAT "%d (over %.0fx a script's median)\n",
+         "expensive faces", num_expensive, SHAPING_OUTLIER_FACTOR);
+  printf("\n");
+  free(costs);
+  free(sorted_costs);
+  free(expensive_faces);
+  free(faces);
+}
+
+// Maximum number of rendering settings searched by --tune-rendering.
+#define TUNE_MAX_CANDIDATES 64
+
+// Maximum number of distinct fonts rendered by --tune-rendering.
+#define TUNE_MAX_FONTS 64
+
+// Size of the buffer that the tuned config fragment is formatted into.
+#define TUNE_CONFIG_SIZE 4096
+
+// Rendering settings searched by --tune-rendering.
+typedef struct {
+  FcBool antialias;
+  FcBool hinting;
+  int hint_style;
+  int rgba;
+  int lcd_filter;
+} RenderingSettings;
+
+// Fills |settings| from |match|, using the same defaults as
+// GetFreeTypeLoadFlags() for unset values.
+void GetRenderingSettings(FcPattern* match, RenderingSettings* settings) {
+  settings->antialias = FcTrue;
+  settings->hinting = FcTrue;
+  settings->hint_style = FC_HINT_FULL;
+  settings->rgba = FC_RGBA_UNKNOWN;
+  settings->lcd_filter = FC_LCD_DEFAULT;
+  FcPatternGetBool(match, FC_ANTIALIAS, 0, &settings->antialias);
+  FcPatternGetBool(match, FC_HINTING, 0, &settings->hinting);
+  FcPatternGetInteger(match, FC_HINT_STYLE, 0, &settings->hint_style);
+  FcPatternGetInteger(match, FC_RGBA, 0, &settings->rgba);
+  FcPatternGetInteger(match, FC_LCD_FILTER, 0, &settings->lcd_filter);
+}
+
+// Replaces the rendering settings in |pattern| with |settings|.
+void SetRenderingSettings(FcPattern* pattern,
+                          const RenderingSettings* settings) {
+  FcPatternDel(pattern, FC_ANTIALIAS);
+  FcPatternDel(pattern, FC_HINTING);
+  FcPatternDel(pattern, FC_HINT_STYLE);
+  FcPatternDel(pattern, FC_RGBA);
+  FcPatternDel(pattern, FC_LCD_FILTER);
+  FcPatternAddBool(pattern, FC_ANTIALIAS, settings->antialias);
+  FcPatternAddBool(pattern, FC_HINTING, settings->hinting);
+  FcPatternAddInteger(pattern, FC_HINT_STYLE, settings->hint_style);
+  FcPatternAddInteger(pattern, FC_RGBA, settings->rgba);
+  FcPatternAddInteger(pattern, FC_LCD_FILTER, settings->lcd_filter);
+}
+
+// Returns 1 for horizontal subpixel orders, 2 for vertical ones, or 0 if
+// subpixel rendering isn't used. Orders with the same orientation render at
+// the same cost.
+int GetRgbaOrientation(int rgba) {
+  switch (rgba) {
+    case FC_RGBA_RGB:
+    case FC_RGBA_BGR:
+      return 1;
+    case FC_RGBA_VRGB:
+    case FC_RGBA_VBGR:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+FT_LcdFilter GetFreeTypeLcdFilter(int lcd_filter) {
+  switch (lcd_filter) {
+    case FC_LCD_NONE:
+      return FT_LCD_FILTER_NONE;
+    case FC_LCD_LIGHT:
+      return FT_LCD_FILTER_LIGHT;
+    case FC_LCD_LEGACY:
+      return FT_LCD_FILTER_LEGACY;
+    default:
+      return FT_LCD_FILTER_DEFAULT;
+  }
+}
+
+// Stores the distinct combinations of rendering settings in |candidates| and
+// returns their count. Settings that FreeType renders identically are only
+// included once: hintmedium is left out since it renders like hintfull,
+// disabling hinting stands in for hintnone, hintslight is left out without
+// antialiasing since monochrome rendering always uses the mono hinting target,
+// and only one subpixel order is included per orientation. The LCD filter is
+// only varied for subpixel rendering, and subpixel rendering only with
+// antialiasing.
+int GetRenderingCandidates(RenderingSettings* candidates) {
+  const int kHintStyles[] = { FC_HINT_NONE, FC_HINT_SLIGHT, FC_HINT_FULL };
+  const int kRgbas[] = { FC_RGBA_NONE, FC_RGBA_RGB, FC_RGBA_VRGB };
+  const int kLcdFilters[] = {
+    FC_LCD_NONE, FC_LCD_DEFAULT, FC_LCD_LIGHT, FC_LCD_LEGACY,
+  };
+  int num_candidates = 0;
+  for (int antialias = 1; antialias >= 0; antialias--) {
+    for (int i = 0; i < 3; i++) {
+      if (!antialias && kHintStyles[i] == FC_HINT_SLIGHT)
+        continue;
+      for (int j = 0; j < (antialias ? 3 : 1); j++) {
+        for (int k = 0; k < (kRgbas[j] != FC_RGBA_NONE ? 4 : 1); k++) {
+          assert(num_candidates < TUNE_MAX_CANDIDATES);
+          RenderingSettings* settings = &candidates[num_candidates++];
+          settings->antialias = antialias;
+          settings->hinting = kHintStyles[i] != FC_HINT_NONE;
+          settings->hint_style = kHintStyles[i];
+          settings->rgba = kRgbas[j];
+          settings->lcd_filter = kLcdFilters[k];
+        }
+      }
+    }
+  }
+  return num_candidates;
+}
+
+// Returns whether |settings| satisfies the values given in |required|.
+// Subpixel orders only need to have the same orientation.
+int MeetsRenderingRequirements(const RenderingSettings* settings,
+                               FcPattern* required) {
+  FcBool b = FcFalse;
+  int i = 0;
+  return (FcPatternGetBool(required, FC_ANTIALIAS, 0, &b) != FcResultMatch ||
+          !b == !settings->antialias) &&
+      (FcPatternGetBool(required, FC_HINTING, 0, &b) != FcResultMatch ||
+       !b == !settings->hinting) &&
+      (FcPatternGetInteger(required, FC_HINT_STYLE, 0, &i) != FcResultMatch ||
+       i == settings->hint_style ||
+       (i == FC_HINT_MEDIUM && settings->hint_style == FC_HINT_FULL)) &&
+      (FcPatternGetInteger(required, FC_RGBA, 0, &i) != FcResultMatch ||
+       GetRgbaOrientation(i) == GetRgbaOrientation(settings->rgba)) &&
+      (FcPatternGetInteger(required, FC_LCD_FILTER, 0, &i) != FcResultMatch ||
+       i == settings->lcd_filter || !GetRgbaOrientation(settings->rgba));
+}
+
+// Replaces values in the searched |settings| with equivalent ones that are
+// given in |required| or, failing that, are already used by |match|. Subpixel
+// orders are a property of the display, so only their orientation is searched,
+// and the LCD filter doesn't matter without subpixel rendering.
+void ApplyEquivalentSettings(RenderingSettings* settings,
+                             FcPattern* required,
+                             FcPattern* match) {
+  RenderingSettings current;
+  GetRenderingSettings(match, &current);
+  int value = 0;
+  if (settings->hinting &&
+      FcPatternGetInteger(required, FC_HINT_STYLE, 0, &value) == FcResultMatch)
+    settings->hint_style = value;
+  const int orientation = GetRgbaOrientation(settings->rgba);
+  if (FcPatternGetInteger(required, FC_RGBA, 0, &value) == FcResultMatch &&
+      GetRgbaOrientation(value) == orientation)
+    settings->rgba = value;
+  else if (orientation && GetRgbaOrientation(current.rgba) == orientation)
+    settings->rgba = current.rgba;
+  if (FcPatternGetInteger(required, FC_LCD_FILTER, 0, &value) == FcResultMatch)
+    settings->lcd_filter = value;
+  else if (!orientation)
+    settings->lcd_filter = current.lcd_filter;
+}
+
+// Fonts rendered by the rendering tuner, with the load flags, render modes and
+// LCD filters of the settings being measured.
+typedef struct {
+  FT_Library library;
+  int num_fonts;
+  FT_Face faces[TUNE_MAX_FONTS];
+  FcPattern* matches[TUNE_MAX_FONTS];
+  FT_Int32 load_flags[TUNE_MAX_FONTS];
+  FT_Render_Mode render_modes[TUNE_MAX_FONTS];
+  FT_LcdFilter lcd_filters[TUNE_MAX_FONTS];
+} TuneBenchmarkData;
+
+void RunTuneBenchmarkIteration(void* data) {
+  const TuneBenchmarkData* tune = (const TuneBenchmarkData*) data;
+  for (int i = 0; i < tune->num_fonts; i++) {
+    FT_Library_SetLcdFilter(tune->library, tune->lcd_filters[i]);
+    for (const char* ch = kRenderBenchmarkText; *ch; ch++) {
+      RenderGlyph(tune->faces[i], *ch, tune->load_flags[i],
+                  tune->render_modes[i]);
+    }
+  }
+}
+
+// Sets the load flags, render modes and LCD filters in |tune| for rendering
+// its fonts with |settings|, or with each font's own settings if it is NULL.
+void SetTuneSettings(TuneBenchmarkData* tune,
+                     const RenderingSettings* settings) {
+  for (int i = 0; i < tune->num_fonts; i++) {
+    FcPattern* pattern = FcPatternDuplicate(tune->matches[i]);
+    assert(pattern);
+    if (settings)
+      SetRenderingSettings(pattern, settings);
+    RenderingSettings actual;
+    GetRenderingSettings(pattern, &actual);
+    tune->load_flags[i] = GetFreeTypeLoadFlags(pattern);
+    tune->render_modes[i] = GetFreeTypeRenderMode(pattern);
+    tune->lcd_filters[i] = GetFreeTypeLcdFilter(actual.lcd_filter);
+    FcPatternDestroy(pattern);
+  }
+}
+
+// Returns the number of bytes of bitmaps for the distinct glyphs that
+// RunTuneBenchmarkIteration() renders, i.e. what a glyph cache would hold.
+long GetTuneGlyphMemory(const TuneBenchmarkData* tune) {
+  long size = 0;
+  for (int i = 0; i < tune->num_fonts; i++) {
+    FT_Library_SetLcdFilter(tune->library, tune->lcd_filters[i]);
+    for (const char* ch = kRenderBenchmarkText; *ch; ch++) {
+      if (strchr(kRenderBenchmarkText, *ch) != ch ||
+          !RenderGlyph(tune->faces[i], *ch, tune->load_flags[i],
+                       tune->render_modes[i]))
+        continue;
+      const FT_Bitmap* bitmap = &tune->faces[i]->glyph->bitmap;
+      size += (long) abs(bitmap->pitch) * bitmap->rows;
+    }
+  }
+  return size;
+}
+
+// Measured cost of a candidate.
+typedef struct {
+  const RenderingSettings* settings;
+  double raster_ns;
+  long memory;
+  int allowed;
+  int minimize_memory;
+} TuneCandidateResult;
+
+// Sorts allowed candidates before the rest, and then by the objective, using
+// the other cost to break ties.
+int CompareTuneCandidates(const void* a, const void* b) {
+  const TuneCandidateResult* ra = (const TuneCandidateResult*) a;
+  const TuneCandidateResult* rb = (const TuneCandidateResult*) b;
+  if (ra->allowed != rb->allowed)
+    return rb->allowed - ra->allowed;
+  const double costs_a[2] = { ra->raster_ns, ra->memory };
+  const double costs_b[2] = { rb->raster_ns, rb->memory };
+  const int first = ra->minimize_memory ? 1 : 0;
+  const int order = CompareDoubles(&costs_a[first], &costs_b[first]);
+  return order ? order :
+      CompareDoubles(&costs_a[1 - first], &costs_b[1 - first]);
+}
+
+// Formats |settings| into |str| as antialias, hinting, hintstyle, rgba and
+// lcdfilter columns.
+void FormatRenderingSettings(const RenderingSettings* settings,
+                             char* str,
+                             size_t size) {
+  snprintf(str, size, "%-10d %-8d %-10s %-6s %-10s", settings->antialias,
+           settings->hinting,
+           GetFontconfigHintStyleString(settings->hint_style),
+           GetFontconfigRgbaString(settings->rgba),
+           GetFontconfigLcdFilterString(settings->lcd_filter));
+}
+
+// Renders the fonts that the default workload (or the queries in
+// |workload_path|, plus |extra_desc|) resolves to with each distinct
+// combination of antialiasing, hinting, hint style, subpixel order and LCD
+// filter, and measures the raster time and the glyph bitmap memory of each.
+// The cheapest combination satisfying the values in the Fontconfig pattern
+// |required| (e.g. ":antialias=true:rgba=none" for grayscale antialiasing),
+// by raster time or by memory if |minimize_memory| is set, is written to
+// |path| as a config fragment. The fragment is verified by matching the
+// workload with it added to the current config, and the tuned settings are
+// benchmarked against the fonts' current ones. Returns false on failure.
+int TuneRenderingSettings(const BenchmarkOptions* options,
+                          const char* path,
+                          const char* workload_path,
+                          const char* extra_desc,
+                          FcPattern* required,
+                          int minimize_memory) {
+  int num_queries = 0;
+  FlattenQuery* queries =
+      ReadFlattenWorkload(workload_path, extra_desc, &num_queries);
+  if (!queries) {
+    fprintf(stderr, "Failed to load the workload\n");
+    return 0;
+  }
+  TuneBenchmarkData tune;
+  memset(&tune, 0, sizeof(tune));
+  if (FT_Init_FreeType(&tune.library) != 0) {
+    fprintf(stderr, "Failed to initialize FreeType\n");
+    for (int i = 0; i < num_queries; i++)
+      FcPatternDestroy(queries[i].query);
+    free(queries);
+    return 0;
+  }
+
+  // Render each distinct font and size once.
+  for (int i = 0; i < num_queries && tune.num_fonts < TUNE_MAX_FONTS; i++) {
+    FcPattern* query = FcPatternDuplicate(queries[i].query);
+    FcPattern* match = MatchFontconfigQuery(NULL, query);
+    FcPatternDestroy(query);
+    FcChar8* file = NULL;
+    int index = 0;
+    double pixel_size = 0.0;
+    FcPatternGetString(match, FC_FILE, 0, &file);
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &pixel_size);
+    int duplicate = 0;
+    for (int j = 0; file && !duplicate && j < tune.num_fonts; j++) {
+      FcChar8* other_file = NULL;
+      int other_index = 0;
+      double other_size = 0.0;
+      FcPatternGetString(tune.matches[j], FC_FILE, 0, &other_file);
+      FcPatternGetInteger(tune.matches[j], FC_INDEX, 0, &other_index);
+      FcPatternGetDouble(tune.matches[j], FC_PIXEL_SIZE, 0, &other_size);
+      duplicate = strcmp((const char*) file, (const char*) other_file) == 0 &&
+          index == other_index && pixel_size == other_size;
+    }
+    FT_Face face = NULL;
+    if (!file || duplicate ||
+        FT_New_Face(tune.library, (const char*) file, index, &face) != 0) {
+      FcPatternDestroy(match);
+      continue;
+    }
+    FT_Set_Pixel_Sizes(face, 0, pixel_size > 0 ? pixel_size : 16);
+    tune.faces[tune.num_fonts] = face;
+    tune.matches[tune.num_fonts++] = match;
+  }
+
+  // Search with looser statistics, since only the winner's gains are
+  // reported.
+  BenchmarkOptions search_options = *options;
+  search_options.output = NULL;
+  if (search_options.target_ci < 0.05)
+    search_options.target_ci = 0.05;
+  if (search_options.max_samples > 20)
+    search_options.max_samples = 20;
+  if (search_options.min_samples > search_options.max_samples)
+    search_options.min_samples = search_options.max_samples;
+
+  RenderingSettings candidates[TUNE_MAX_CANDIDATES];
+  const int num_candidates = GetRenderingCandidates(candidates);
+  TuneCandidateResult results[TUNE_MAX_CANDIDATES];
+  int num_allowed = 0;
+  for (int i = 0; i < num_candidates; i++) {
+    TuneCandidateResult* result = &results[i];
+    result->settings = &candidates[i];
+    result->allowed = MeetsRenderingRequirements(&candidates[i], required);
+    result->minimize_memory = minimize_memory;
+    num_allowed += result->allowed;
+    SetTuneSettings(&tune, &candidates[i]);
+    BenchmarkResult benchmark;
+    free(RunBenchmark(&search_options, "tune-rendering-candidate",
+                      RunTuneBenchmarkIteration, &tune, &benchmark));
+    result->raster_ns = benchmark.median;
+    result->memory = GetTuneGlyphMemory(&tune);
+  }
+  qsort(results, num_candidates, sizeof(TuneCandidateResult),
+        CompareTuneCandidates);
+
+  FcChar8* required_str = FcNameUnparse(required);
+  printf("Rendering candidates (%d font(s), %d of %d allowed by \"%s\", "
+         "minimizing %s):\n", tune.num_fonts, num_allowed, num_candidates,
+         required_str ? (const char*) required_str : "",
+         minimize_memory ? "memory" : "time");
+  if (required_str)
+    FcStrFree(required_str);
+  printf("%-10s %-8s %-10s %-6s %-10s %-12s %s\n", "antialias", "hinting",
+         "hintstyle", "rgba", "lcdfilter", "raster", "memory");
+  for (int i = 0; i < num_candidates; i++) {
+    char settings_str[64], raster_str[32];
+    FormatRenderingSettings(results[i].settings, settings_str,
+                            sizeof(settings_str));
+    FormatDuration(results[i].raster_ns, raster_str, sizeof(raster_str));
+    printf("%s %-12s %.1f KiB%s\n", settings_str, raster_str,
+           results[i].memory / 1024.0, results[i].allowed ? "" : " [excluded]");
+  }
+  printf("\n");
+
+  int ok = tune.num_fonts > 0 && num_allowed > 0;
+  if (!ok)
+    fprintf(stderr, "No fonts were loaded or no settings were allowed\n");
+
+  RenderingSettings tuned = *results[0].settings;
+  if (ok)
+    ApplyEquivalentSettings(&tuned, required, tune.matches[0]);
+
+  OutputArena arena = { malloc(TUNE_CONFIG_SIZE), TUNE_CONFIG_SIZE, 0 };
+  assert(arena.data);
+  ok = ok && ArenaPrintf(
+      &arena,
+      "<?xml version=\"1.0\"?>\n"
+      "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+      "<fontconfig>\n"
+      "  <match target=\"font\">\n"
+      "    <edit name=\"antialias\" mode=\"assign\"><bool>%s</bool></edit>\n"
+      "    <edit name=\"hinting\" mode=\"assign\"><bool>%s</bool></edit>\n"
+      "    <edit name=\"hintstyle\" mode=\"assign\">"
+      "<const>hint%s</const></edit>\n"
+      "    <edit name=\"rgba\" mode=\"assign\"><const>%s</const></edit>\n"
+      "    <edit name=\"lcdfilter\" mode=\"assign\">"
+      "<const>lcd%s</const></edit>\n"
+      "  </match>\n"
+      "</fontconfig>\n",
+      tuned.antialias ? "true" : "false", tuned.hinting ? "true" : "false",
+      GetFontconfigHintStyleString(tuned.hint_style),
+      GetFontconfigRgbaString(tuned.rgba),
+      GetFontconfigLcdFilterString(tuned.lcd_filter));
+  FILE* file = ok ? fopen(path, "w") : NULL;
+  if (file && fwrite(arena.data, 1, arena.used, file) != arena.used) {
+    fclose(file);
+    file = NULL;
+  } else if (file && fclose(file) != 0) {
+    file = NULL;
+  }
+  if (ok && !file)
+    perror(path);
+  free(arena.data);
+
+  // Check that the fragment takes effect on top of the current config.
+  FcConfig* config = NULL;
+  if (file) {
+    config = FcConfigCreate();
+    assert(config);
+    if (!FcConfigParseAndLoad(config, NULL, FcTrue) ||
+        !FcConfigParseAndLoad(config, (const FcChar8*) path, FcTrue) ||
+        !FcConfigBuildFonts(config)) {
+      fprintf(stderr, "Failed to load %s\n", path);
+      FcConfigDestroy(config);
+      config = NULL;
+    }
+  }
+  int num_verified = 0;
+  for (int i = 0; config && i < num_queries; i++) {
+    FcPattern* query = FcPatternDuplicate(queries[i].query);
+    FcPattern* match = MatchFontconfigQuery(config, query);
+    RenderingSettings actual;
+    GetRenderingSettings(match, &actual);
+    num_verified += !actual.antialias == !tuned.antialias &&
+        !actual.hinting == !tuned.hinting &&
+        actual.hint_style == tuned.hint_style && actual.rgba == tuned.rgba &&
+        actual.lcd_filter == tuned.lcd_filter;
+    FcPatternDestroy(match);
+    FcPatternDestroy(query);
+  }
+
+  if (config) {
+    printf("Tuned rendering settings (%s):\n", path);
+    printf(NAME_FORMAT "%s\n", "antialias", tuned.antialias ? "true" : "false");
+    printf(NAME_FORMAT "%s\n", "hinting", tuned.hinting ? "true" : "false");
+    printf(NAME_FORMAT "%s\n", "hintstyle",
+           GetFontconfigHintStyleString(tuned.hint_style));
+    printf(NAME_FORMAT "%s\n", "rgba", GetFontconfigRgbaString(tuned.rgba));
+    printf(NAME_FORMAT "%s\n", "lcdfilter",
+           GetFontconfigLcdFilterString(tuned.lcd_filter));
+    printf(NAME_FORMAT "%d of %d\n", "verified queries", num_verified,
+           num_queries);
+    fflush(stdout);
+
+    BenchmarkResult current_result, tuned_result;
+    SetTuneSettings(&tune, NULL);
+    const long current_memory = GetTuneGlyphMemory(&tune);
+    free(RunBenchmark(options, "tune-rendering-current",
+                      RunTuneBenchmarkIteration, &tune, &current_result));
+    SetTuneSettings(&tune, &tuned);
+    const long tuned_memory = GetTuneGlyphMemory(&tune);
+    free(RunBenchmark(options, "tune-rendering-tuned",
+                      RunTuneBenchmarkIteration, &tune, &tuned_result));
+    char current_str[32], tuned_str[32];
+    FormatDuration(current_result.median, current_str, sizeof(current_str));
+    FormatDuration(tuned_result.median, tuned_str, sizeof(tuned_str));
+    printf(NAME_FORMAT "%s -> %s (%+.1f%%)\n", "raster", current_str,
+           tuned_str,
+           100.0 * (tuned_result.median - current_result.median) /
+           current_result.median);
+    printf(NAME_FORMAT "%.1f KiB -> %.1f KiB (%+.1f%%)\n", "glyph memory",
+           current_memory / 1024.0, tuned_memory / 1024.0,
+           current_memory > 0 ?
+           100.0 * (tuned_memory - current_memory) / current_memory : 0.0);
+    printf("\n");
+    FcConfigDestroy(config);
+  }
+  ok = config && num_verified == num_queries;
+
+  for (int i = 0; i < tune.num_fonts; i++) {
+    FT_Done_Face(tune.faces[i]);
+    FcPatternDestroy(tune.matches[i]);
+  }
+  FT_Done_FreeType(tune.library);
+  for (int i = 0; i < num_queries; i++)
+    FcPatternDestroy(queries[i].query);
+  free(queries);
+  return ok;
+}
+
+// Samples of a single metric read from a benchmark output file.
+typedef struct {
+  char name[64];
+  double* values;
+  int num_values;
+  int capacity;
+} BenchmarkSamples;
+
+// Reads "NAME VALUE" lines written by RunBenchmark() from |path| into a newly
+// allocated array, storing its length in |num_metrics|. Returns NULL on error
+// or if the file has no samples.
+BenchmarkSamples* ReadBenchmarkSamples(const char* path, int* num_metrics) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return NULL;
+  }
+
+  BenchmarkSamples* metrics = NULL;
+  int capacity = 0;
+  *num_metrics = 0;
+  char name[64];
+  double value = 0.0;
+  while (fscanf(file, "%63s %lf", name, &value) == 2) {
+    BenchmarkSamples* metric = NULL;
+    for (int i = 0; i < *num_metrics && !metric; i++) {
+      if (strcmp(metrics[i].name, name) == 0)
+        metric = &metrics[i];
+    }
+    if (!metric) {
+      if (*num_metrics == capacity) {
+        capacity = capacity ? capacity * 2 : 4;
+        metrics = realloc(metrics, capacity * sizeof(BenchmarkSamples));
+        assert(metrics);
+      }
+      metric = &metrics[(*num_metrics)++];
+      memset(metric, 0, sizeof(*metric));
+      strcpy(metric->name, name);
+    }
+    if (metric->num_values == metric->capacity) {
+      metric->capacity = metric->capacity ? metric->capacity * 2 : 64;
+      metric->values =
+          realloc(metric->values, metric->capacity * sizeof(double));
+      assert(metric->values);
+    }
+    metric->values[metric->num_values++] = value;
+  }
+  if (!feof(file))
+    fprintf(stderr, "%s: ignoring malformed data\n", path);
+  fclose(file);
+  if (*num_metrics == 0)
+    fprintf(stderr, "%s: no samples\n", path);
+  return metrics;
+}
+
+void FreeBenchmarkSamples(BenchmarkSamples* metrics, int num_metrics) {
+  for (int i = 0; i < num_metrics; i++)
+    free(metrics[i].values);
+  free(metrics);
+}
+
+// Result of comparing a metric's baseline and candidate samples.
+typedef struct {
+  double baseline_median;
+  double candidate_median;
+  double shift;     // Hodges-Lehmann estimate of candidate minus baseline.
+  double shift_lo;  // Bounds of the 1 - alpha confidence interval of |shift|.
+  double shift_hi;
+  double p_value;   // Two-sided Mann-Whitney U test.
+} BenchmarkComparison;
+
+// Returns the median of |values|, which is sorted in-place.
+double SortAndGetMedian(double* values, int num_values) {
+  qsort(values, num_values, sizeof(double), CompareDoubles);
+  return GetQuantile(values, num_values, 0.5);
+}
+
+// Returns z such that a standard normal variable exceeds it in absolute value
+// with probability |alpha|.
+double GetTwoSidedNormalQuantile(double alpha) {
+  double lo = 0.0, hi = 40.0;
+  for (int i = 0; i < 100; i++) {
+    const double mid = (lo + hi) / 2.0;
+    if (erfc(mid / sqrt(2.0)) > alpha)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return (lo + hi) / 2.0;
+}
+
+// Compares |baseline| and |candidate| using the Mann-Whitney U test (with the
+// normal approximation and tie correction) and the Hodges-Lehmann estimator,
+// neither of which assume that timings are normally distributed. The shift's
+// confidence interval is at the 1 - |alpha| level.
+void CompareBenchmarkSamples(const BenchmarkSamples* baseline,
+                             const BenchmarkSamples* candidate,
+                             double alpha,
+                             BenchmarkComparison* comparison) {
+  const int n1 = baseline->num_values, n2 = candidate->num_values;
+  const int n = n1 + n2;
+
+  double* a = malloc(n1 * sizeof(double));
+  double* b = malloc(n2 * sizeof(double));
+  assert(a && b);
+  memcpy(a, baseline->values, n1 * sizeof(double));
+  memcpy(b, candidate->values, n2 * sizeof(double));
+  comparison->baseline_median = SortAndGetMedian(a, n1);
+  comparison->candidate_median = SortAndGetMedian(b, n2);
+
+  // Walk the sorted samples together, assigning average ranks to ties and
+  // summing the ranks of the baseline samples.
+  double rank_sum = 0.0, tie_term = 0.0;
+  int i = 0, j = 0;
+  while (i < n1 || j < n2) {
+    const double value = (j >= n2 || (i < n1 && a[i] <= b[j])) ? a[i] : b[j];
+    int count_a = 0, count_b = 0;
+    while (i < n1 && a[i] == value) {
+      i++;
+      count_a++;
+    }
+    while (j < n2 && b[j] == value) {
+      j++;
+      count_b++;
+    }
+    const int count = count_a + count_b;
+    const int first_rank = i + j - count + 1;
+    rank_sum += count_a * (first_rank + (count - 1) / 2.0);
+    tie_term += (double) count * count * count - count;
+  }
+  const double u = rank_sum - n1 * (n1 + 1) / 2.0;
+  const double mean_u = n1 * (double) n2 / 2.0;
+  const double var_u =
+      n1 * (double) n2 / 12.0 * ((n + 1) - tie_term / ((double) n * (n - 1)));
+  comparison->p_value =
+      var_u > 0 ? erfc(fabs(u - mean_u) / sqrt(var_u) / sqrt(2.0)) : 1.0;
+
+  // The Hodges-Lehmann shift is the median of all pairwise differences, and
+  // its confidence interval comes from the same U distribution.
+  const long num_diffs = (long) n1 * n2;
+  double* diffs = malloc(num_diffs * sizeof(double));
+  assert(diffs);
+  for (int x = 0; x < n1; x++) {
+    for (int y = 0; y < n2; y++)
+      diffs[(long) x * n2 + y] = b[y] - a[x];
+  }
+  qsort(diffs, num_diffs, sizeof(double), CompareDoubles);
+  comparison->shift = GetQuantile(diffs, num_diffs, 0.5);
+  // The bounds are the C-th smallest and largest differences (1-indexed).
+  const double z = GetTwoSidedNormalQuantile(alpha);
+  long c = (long) floor(mean_u - z * sqrt(n1 * (double) n2 * (n + 1) / 12.0));
+  if (c < 1)
+    c = 1;
+  comparison->shift_lo = diffs[c - 1];
+  comparison->shift_hi = diffs[num_diffs - c];
+
+  free(diffs);
+  free(a);
+  free(b);
+}
+
+// Compares the benchmark samples in |baseline_path| and |candidate_path| and
+// prints per-metric deltas. Returns the number of metrics that changed
+// significantly, or -1 on error. The significance level is
+// Bonferroni-corrected for the number of metrics compared.
+int CompareBenchmarkFiles(const char* baseline_path,
+                          const char* candidate_path) {
+  int num_baseline = 0, num_candidate = 0;
+  BenchmarkSamples* baseline = ReadBenchmarkSamples(baseline_path,
+                                                    &num_baseline);
+  BenchmarkSamples* candidate = ReadBenchmarkSamples(candidate_path,
+                                                     &num_candidate);
+  if (!baseline || !candidate) {
+    FreeBenchmarkSamples(baseline, num_baseline);
+    FreeBenchmarkSamples(candidate, num_candidate);
+    return -1;
+  }
+
+  int num_compared = 0;
+  for (int i = 0; i < num_baseline; i++) {
+    for (int j = 0; j < num_candidate; j++) {
+      if (strcmp(baseline[i].name, candidate[j].name) == 0)
+        num_compared++;
+    }
+  }
+  const double kAlpha = 0.05;
+  const double alpha = num_compared > 0 ? kAlpha / num_compared : kAlpha;
+
+  int num_changed = 0;
+  for (int i = 0; i < num_baseline; i++) {
+    const BenchmarkSamples* metric = NULL;
+    for (int j = 0; j < num_candidate && !metric; j++) {
+      if (strcmp(baseline[i].name, candidate[j].name) == 0)
+        metric = &candidate[j];
+    }
+    printf("Comparison (%s):\n", baseline[i].name);
+    if (!metric) {
+      printf("[missing from %s]\n\n", candidate_path);
+      continue;
+    }
+    if (baseline[i].num_values < 2 || metric->num_values < 2) {
+      printf("[too few samples]\n\n");
+      continue;
+    }
+
+    BenchmarkComparison comparison;
+    CompareBenchmarkSamples(&baseline[i], metric, alpha, &comparison);
+    const double base = comparison.baseline_median;
+    printf(NAME_FORMAT "%d\n", "baseline samples", baseline[i].num_values);
+    printf(NAME_FORMAT "%d\n", "candidate samples", metric->num_values);
+    PrintDuration("baseline median", comparison.baseline_median);
+    PrintDuration("candidate median", comparison.candidate_median);
+    printf(NAME_FORMAT "%+.2f%% (%.4g%% CI %+.2f%% to %+.2f%%)\n", "delta",
+           100.0 * comparison.shift / base, 100.0 * (1.0 - alpha),
+           100.0 * comparison.shift_lo / base,
+           100.0 * comparison.shift_hi / base);
+    printf(NAME_FORMAT "%.4g (alpha %.4g)\n", "p-value", comparison.p_value,
+           alpha);
+
+    const int significant = comparison.p_value < alpha &&
+        (comparison.shift_lo > 0 || comparison.shift_hi < 0);
+    if (significant)
+      num_changed++;
+    printf(NAME_FORMAT "%s\n", "verdict",
+           !significant ? "no significant change" :
+               (comparison.shift > 0 ? "slower" : "faster"));
+    printf("\n");
+  }
+  for (int j = 0; j < num_candidate; j++) {
+    int found = 0;
+    for (int i = 0; i < num_baseline && !found; i++)
+      found = strcmp(baseline[i].name, candidate[j].name) == 0;
+    if (!found)
+      printf("Comparison (%s):\n[missing from %s]\n\n", candidate[j].name,
+             baseline_path);
+  }
+
+  printf("%d of %d metric(s) changed significantly\n", num_changed,
+         num_compared);
+  FreeBenchmarkSamples(baseline, num_baseline);
+  FreeBenchmarkSamples(candidate, num_candidate);
+  return num_changed;
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  int bold = 0, italic = 0;
+  const char* user_font_desc = NULL;
+  const char** xresource_homes = calloc(argc, sizeof(char*));
+  int num_xresource_homes = 0;
+  assert(xresource_homes);
+  int benchmark_modes = 0;
+  BenchmarkOptions benchmark_options = {
+    .num_cpus = 0,
+    .target_ci = 0.01,
+    .min_samples = 10,
+    .max_samples = 1000,
+    .min_sample_sec = 0.01,
+    .output = NULL,
+  };
+  int compare = 0;
+  int batch = 0;
+  int run_daemon = 0;
+  const char* daemon_socket = NULL;
+  const char* daemon_state = NULL;
+  int idle_timeout_sec = 0;
+  long long context_memory_limit = 256LL * 1024 * 1024;
+  const char* profile_path = NULL;
+  const char* capture_dir = NULL;
+  const char* replay_dir = NULL;
+  // The argv elements that --replay options were parsed from.
+  const char** replay_args = calloc(argc, sizeof(char*));
+  int num_replay_args = 0;
+  assert(replay_args);
+  const char* inventory_dir = NULL;
+  const char* config_scaling_dir = NULL;
+  int max_rules = 10000;
+  const char** fixtures = calloc(argc, sizeof(char*));
+  int num_fixtures = 0;
+  int max_faces = 100000;
+  assert(fixtures);
+  const char* flatten_path = NULL;
+  const char* prune_path = NULL;
+  const char* workload_path = NULL;
+  int outline_stats = 0;
+  int shaping_sweep = 0;
+  const char* tune_path = NULL;
+  FcPattern* tune_required = NULL;
+  int tune_minimize_memory = 0;
+  int x_font_timing = 0;
+  const struct option kLongOptions[] = {
+    { "batch", no_argument, NULL, 'Q' },
+    { "capture", required_argument, NULL, 'K' },
+    { "replay", required_argument, NULL, 'R' },
+    { "require", required_argument, NULL, 'E' },
+    { "state", required_argument, NULL, 'S' },
+    { "compare", no_argument, NULL, 'C' },
+    { "config-scaling", required_argument, NULL, 'G' },
+    { "context-memory", required_argument, NULL, 'A' },
+    { "daemon", optional_argument, NULL, 'D' },
+    { "fixture", required_argument, NULL, 'F' },
+    { "flatten", required_argument, NULL, 'L' },
+    { "idle-timeout", required_argument, NULL, 'T' },
+    { "inventory-scaling", required_argument, NULL, 'I' },
+    { "max-faces", required_argument, NULL, 'M' },
+    { "max-rules", required_argument, NULL, 'N' },
+    { "minimize", required_argument, NULL, 'Z' },
+    { "outline-stats", no_argument, NULL, 'O' },
+    { "profile", required_argument, NULL, 'P' },
+    { "prune-dirs", required_argument, NULL, 'U' },
+    { "shaping-sweep", no_argument, NULL, 'H' },
+    { "tune-rendering", required_argument, NULL, 'V' },
+    { "workload", required_argument, NULL, 'W' },
+    { "x-font-timing", no_argument, NULL, 'Y' },
+    { NULL, 0, NULL, 0 },
+  };
+  while ((opt = getopt_long(argc, argv, "B:bc:e:f:hio:X:", kLongOptions,
+                            NULL)) != -1) {
+    switch (opt) {
+      case 'A':
+        context_memory_limit = atoll(optarg) * 1024 * 1024;
+        break;
+      case 'B':
+        if (!GetBenchmarkMode(optarg)) {
+          fprintf(stderr, "Unknown benchmark \"%s\"\n", optarg);
+          return 1;
+        }
+        benchmark_modes |= GetBenchmarkMode(optarg);
+        break;
+      case 'b':
+        bold = 1;
+        break;
+      case 'C':
+        compare = 1;
+        break;
+      case 'D':
+        run_daemon = 1;
+        daemon_socket = optarg;
+        break;
+      case 'E':
+        if (tune_required)
+          FcPatternDestroy(tune_required);
+        tune_required = FcNameParse((const FcChar8*) optarg);
+        if (!tune_required) {
+          fprintf(stderr, "Invalid Fontconfig pattern \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'F':
+        fixtures[num_fixtures++] = optarg;
+        break;
+      case 'G':
+        config_scaling_dir = optarg;
+        break;
+      case 'H':
+        shaping_sweep = 1;
+        break;
+      case 'I':
+        inventory_dir = optarg;
+        break;
+      case 'M':
+        max_faces = atoi(optarg);
+        if (max_faces < 10) {
+          fprintf(stderr, "--max-faces must be at least 10\n");
+          return 1;
+        }
+        break;
+      case 'N':
+        max_rules = atoi(optarg);
+        if (max_rules < 10) {
+          fprintf(stderr, "--max-rules must be at least 10\n");
+          return 1;
+        }
+        break;
+      case 'c':
+        if (!ParseBenchmarkCpus(optarg, &benchmark_options)) {
+          fprintf(stderr, "Invalid CPU list \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'e':
+        benchmark_options.target_ci = atof(optarg) / 100.0;
+        if (benchmark_options.target_ci <= 0.0) {
+          fprintf(stderr, "Invalid confidence interval \"%s\"\n", optarg);
+          return 1;
+        }
+        break;
+      case 'f':
+        user_font_desc = optarg;
+        break;
+      case 'i':
+        italic = 1;
+        break;
+      case 'K':
+        capture_dir = optarg;
+        break;
+      case 'L':
+        flatten_path = optarg;
+        break;
+      case 'O':
+        outline_stats = 1;
+        break;
+      case 'P':
+        profile_path = optarg;
+        break;
+      case 'R':
+        replay_dir = optarg;
+        // The option is in the last element parsed, unless its argument is.
+        if (optarg == argv[optind - 1])
+          replay_args[num_replay_args++] = argv[optind - 2];
+        replay_args[num_replay_args++] = argv[optind - 1];
+        break;
+      case 'S':
+        daemon_state = optarg;
+        break;
+      case 'T':
+        idle_timeout_sec = atoi(optarg);
+        break;
+      case 'U':
+        prune_path = optarg;
+        break;
+      case 'V':
+        tune_path = optarg;
+        break;
+      case 'W':
+        workload_path = optarg;
+        break;
+      case 'Z':
+        if (strcmp(optarg, "time") != 0 && strcmp(optarg, "memory") != 0) {
+          fprintf(stderr, "--minimize must be \"time\" or \"memory\"\n");
+          return 1;
+        }
+        tune_minimize_memory = strcmp(optarg, "memory") == 0;
+        break;
+      case 'Q':
+        batch = 1;
+        break;
+      case 'o':
+        benchmark_options.output = fopen(optarg, "w");
+        if (!benchmark_options.output) {
+          perror(optarg);
+          return 1;
+        }
+        break;
+      case 'X':
+        xresource_homes[num_xresource_homes++] = optarg;
+        break;
+      case 'Y':
+        x_font_timing = 1;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "       %s --compare BASELINE CANDIDATE\n"
+                "\n"
+                "Options:\n"
+                "  -B MODE  Run a benchmark instead of printing info: match,\n"
+                "           startup, or render (may be repeated)\n"
+                "  -b       Request bold font from Fontconfig\n"
+                "  -c CPUS  Pin benchmark threads to comma-separated CPUs\n"
+                "  -e PCT   Target benchmark 95%% confidence interval\n"
+                "           (default 1)\n"
+                "  -f DESC  Specify Pango font description for Fontconfig\n"
+                "  -i       Request italic font from Fontconfig\n"
+                "  -o FILE  Write raw benchmark samples to FILE\n"
+                "  -X HOME  Print Xresources files from HOME without\n"
+                "           connecting to X (may be repeated)\n"
+                "  --batch  Read font descriptions from stdin and write\n"
+                "           tab-separated matches to stdout\n"
+                "  --capture=DIR\n"
+                "           Save the font environment to DIR for --replay\n"
+                "  --compare\n"
+                "           Compare two -o sample files and exit with 2 if\n"
+                "           any metric changed significantly\n"
+                "  --config-scaling=DIR\n"
+                "           Measure substitution and matching with 10 to\n"
+                "           --max-rules (default 10000) synthetic conf.d\n"
+                "           snippets generated in DIR\n"
+                "  --context-memory=MIB\n"
+                "           Limit the daemon's config contexts to MIB\n"
+                "           (default 256; 0 for no limit)\n"
+                "  --daemon[=SOCKET]\n"
+                "           Serve --batch queries on a Unix socket, or on\n"
+                "           one passed via LISTEN_FDS\n"
+                "  --fixture=FILE\n"
+                "           Font to clone for --inventory-scaling (may be\n"
+                "           repeated; defaults to the matched font)\n"
+                "  --flatten=FILE\n"
+                "           Write a single config to FILE that is equivalent\n"
+                "           to the current one for --workload, verify it, and\n"
+                "           compare loading and matching with both\n"
+                "  --idle-timeout=SECS\n"
+                "           Exit the daemon after SECS without requests\n"
+                "  --inventory-scaling=DIR\n"
+                "           Measure Fontconfig against synthetic inventories\n"
+                "           of 10 to --max-faces (default 100000) faces\n"
+                "           generated in DIR\n"
+                "  --outline-stats\n"
+                "           Measure glyph outline complexity in each\n"
+                "           installed face and correlate it with\n"
+                "           rasterization time\n"
+                "  --profile=FILE\n"
+                "           Write folded stacks sampled from long-running\n"
+                "           modes to FILE\n"
+                "  --prune-dirs=FILE\n"
+                "           Write a config to FILE without the font dirs that\n"
+                "           neither --workload nor a locale sweep selects\n"
+                "           from, verify it, and compare loading both\n"
+                "  --replay=DIR\n"
+                "           Run the other options (e.g. -B) in the font\n"
+                "           environment saved in DIR by --capture\n"
+                "  --shaping-sweep\n"
+                "           Rank installed faces by the time to shape a\n"
+                "           sample of each script that they cover\n"
+                "  --state=FILE\n"
+                "           Load and save the daemon's cached results\n"
+                "  --tune-rendering=FILE\n"
+                "           Write the rendering settings to FILE that are\n"
+                "           cheapest for --workload and have the values in\n"
+                "           the Fontconfig pattern --require (e.g.\n"
+                "           \":antialias=true:rgba=none\"), minimizing\n"
+                "           --minimize=time (default) or memory, and compare\n"
+                "           them with the current settings\n"
+                "  --workload=FILE\n"
+                "           Font descriptions to --flatten, --prune-dirs or\n"
+                "           --tune-rendering for, one per line\n"
+                "           (defaults to the generic families, plus -f)\n"
+                "  --x-font-timing\n"
+                "           Repeat X core font lookups and time loading the\n"
+                "           fonts in the info printout\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+  }
+
+  if (replay_dir) {
+    // Rerun with the same arguments minus --replay.
+    char** child_argv = calloc(argc + 1, sizeof(char*));
+    assert(child_argv);
+    int child_argc = 0;
+    for (int i = 0; i < argc; i++) {
+      int is_replay_arg = 0;
+      for (int j = 0; j < num_replay_args && !is_replay_arg; j++)
+        is_replay_arg = argv[i] == replay_args[j];
+      if (!is_replay_arg)
+        child_argv[child_argc++] = argv[i];
+    }
+    const int status = ReplayEnvironment(replay_dir, child_argv);
+    free(child_argv);
+    free(replay_args);
+    return status;
+  }
+
+  if (compare) {
+    if (argc - optind != 2) {
+      fprintf(stderr, "--compare requires two sample files\n");
+      return 1;
+    }
+    const int num_changed = CompareBenchmarkFiles(argv[optind],
+                                                  argv[optind + 1]);
+    return num_changed < 0 ? 1 : (num_changed > 0 ? 2 : 0);
+  }
+
+  if (num_xresource_homes > 0) {
+    PrintOfflineXResources(xresource_homes, num_xresource_homes);
+    return 0;
+  }
+
+  if (run_daemon) {
+    if (profile_path)
+      ProfilerStart();
+    const int status = RunDaemon(daemon_socket, idle_timeout_sec,
+                                 daemon_state, context_memory_limit);
+    if (profile_path)
+      ProfilerStop(profile_path);
+    return status;
+  }
+
+  if (batch) {
+    if (profile_path)
+      ProfilerStart();
+    RunBatch();
+    if (profile_path)
+      ProfilerStop(profile_path);
+    return 0;
+  }
+
+  if (flatten_path) {
+    if (profile_path)
+      ProfilerStart();
+    const int ok = FlattenConfig(&benchmark_options, flatten_path,
+                                 workload_path, user_font_desc);
+    if (profile_path)
+      ProfilerStop(profile_path);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return ok ? 0 : 1;
+  }
+
+  if (prune_path) {
+    const int ok = PruneFontDirs(&benchmark_options, prune_path,
+                                 workload_path, user_font_desc);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return ok ? 0 : 1;
+  }
+
+  if (outline_stats) {
+    if (profile_path)
+      ProfilerStart();
+    RunOutlineStats(&benchmark_options);
+    if (profile_path)
+      ProfilerStop(profile_path);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return 0;
+  }
+
+  if (shaping_sweep) {
+    if (profile_path)
+      ProfilerStart();
+    RunShapingSweep(&benchmark_options);
+    if (profile_path)
+      ProfilerStop(profile_path);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return 0;
+  }
+
+  if (tune_path) {
+    if (!tune_required)
+      tune_required = FcPatternCreate();
+    assert(tune_required);
+    if (profile_path)
+      ProfilerStart();
+    const int ok = TuneRenderingSettings(&benchmark_options, tune_path,
+                                         workload_path, user_font_desc,
+                                         tune_required, tune_minimize_memory);
+    if (profile_path)
+      ProfilerStop(profile_path);
+    FcPatternDestroy(tune_required);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return ok ? 0 : 1;
+  }
+
+  // Benchmarks only need GTK to look up the default font.
+  if (benchmark_modes || inventory_dir || config_scaling_dir) {
+    if (!user_font_desc)
+      gtk_init(&argc, &argv);
+    PangoFontDescription* desc = GetFontDescription(user_font_desc);
+    if (profile_path)
+      ProfilerStart();
+    if (benchmark_modes)
+      RunBenchmarks(&benchmark_options, benchmark_modes, desc, bold, italic);
+    if (inventory_dir) {
+      FcPattern* query = CreateFontconfigQuery(desc, bold, italic);
+      FcPattern* match = MatchFontconfigQuery(NULL, query);
+      FcChar8* file = NULL;
+      if (num_fixtures == 0 &&
+          FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch)
+        fixtures[num_fixtures++] = (const char*) file;
+      RunInventoryScaling(&benchmark_options, inventory_dir, fixtures,
+                          num_fixtures, max_faces);
+      FcPatternDestroy(match);
+      FcPatternDestroy(query);
+    }
+    if (config_scaling_dir) {
+      FcPattern* query = CreateFontconfigQuery(desc, bold, italic);
+      RunConfigScaling(&benchmark_options, config_scaling_dir, query,
+                       max_rules);
+      FcPatternDestroy(query);
+    }
+    if (profile_path)
+      ProfilerStop(profile_path);
+    pango_font_description_free(desc);
+    if (benchmark_options.output)
+      fclose(benchmark_options.output);
+    return 0;
+  }
+
+  if (capture_dir) {
+    gtk_init(&argc, &argv);
+    return CaptureEnvironment(capture_dir) ? 0 : 1;
+  }
 
   time_t now = time(NULL);
   printf("Running at %s\n", ctime(&now));
@@ -425,6 +6748,7 @@ int main(int argc, char** argv) {
   PrintGnomeSettings();
   PrintXDisplayInfo();
   PrintXResources();
+  PrintXCoreFonts(x_font_timing);
   PrintXSettings();
   PrintFontconfigMatch(user_font_desc, bold, italic);
   PrintFontconfigDefaults();